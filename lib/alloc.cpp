@@ -0,0 +1,128 @@
+#include "snowman.hpp"
+#if defined(SNOWMAN_HEAP_BYTES) && defined(__linux__)
+#include <cstdlib>    // malloc, free
+#include <new>        // std::bad_alloc, std::nothrow_t
+#include <malloc.h>   // malloc_usable_size, memalign
+#endif
+
+// the global operator new and delete, replaced so that Heap can count bytes
+// (see heap.cpp). that's every allocation of the program, so it's only done
+// when built with SNOWMAN_HEAP_BYTES (the Makefile does, for the command
+// line; a program that embeds Snowman can leave it out and keep its own
+// allocator). they're kept in a file of their own: anywhere they can be
+// inlined into the standard containers, the compiler sees free() called on
+// what came from operator new and warns about a mismatch that isn't one
+
+#if defined(SNOWMAN_HEAP_BYTES) && defined(__linux__)
+
+const bool Heap::countsBytes = true;
+
+// (every form of operator new and delete ends up in one of these, so none of
+//   them is left to the standard library's, which would count half of it)
+static void* counted(void* p) {
+    if (p && Heap::current) Heap::current->allocated(malloc_usable_size(p));
+    return p;
+}
+
+static void uncounted(void* p) {
+    if (p && Heap::current) Heap::current->freed(malloc_usable_size(p));
+    free(p);
+}
+
+void* operator new(size_t n) {
+    void* p = counted(malloc(n ? n : 1));
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t n) {
+    return operator new(n);
+}
+
+void* operator new(size_t n, const std::nothrow_t&) noexcept {
+    return counted(malloc(n ? n : 1));
+}
+
+void* operator new[](size_t n, const std::nothrow_t&) noexcept {
+    return counted(malloc(n ? n : 1));
+}
+
+void operator delete(void* p) noexcept {
+    uncounted(p);
+}
+
+void operator delete[](void* p) noexcept {
+    uncounted(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    uncounted(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    uncounted(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept {
+    uncounted(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    uncounted(p);
+}
+#endif
+
+#ifdef __cpp_aligned_new
+void* operator new(size_t n, std::align_val_t a) {
+    void* p = counted(memalign((size_t)a, n ? n : 1));
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t n, std::align_val_t a) {
+    return operator new(n, a);
+}
+
+void* operator new(size_t n, std::align_val_t a,
+        const std::nothrow_t&) noexcept {
+    return counted(memalign((size_t)a, n ? n : 1));
+}
+
+void* operator new[](size_t n, std::align_val_t a,
+        const std::nothrow_t&) noexcept {
+    return counted(memalign((size_t)a, n ? n : 1));
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    uncounted(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    uncounted(p);
+}
+
+void operator delete(void* p, std::align_val_t,
+        const std::nothrow_t&) noexcept {
+    uncounted(p);
+}
+
+void operator delete[](void* p, std::align_val_t,
+        const std::nothrow_t&) noexcept {
+    uncounted(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    uncounted(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    uncounted(p);
+}
+#endif
+
+#else
+
+const bool Heap::countsBytes = false;
+
+#endif
@@ -0,0 +1,124 @@
+#include "snowman.hpp"
+#include <fstream>    // std::ifstream, std::ofstream
+#include <sstream>    // std::ostringstream
+#include <thread>     // std::thread
+#include <atomic>     // std::atomic
+// included from snowman.hpp: <vector>, <string>, <map>, <chrono>
+
+// running a lot of jobs at once: every script is compiled once, into a Script
+// that jobs only ever read from, and the jobs are spread over a fixed number
+// of threads. nothing else is shared between them: every job gets a Snowman
+// of its own (values are counted without any locking, so even literals have
+// to be its own), reads from its own input file, and writes to a buffer that
+// goes to its output file once it's done
+
+Script::Script(std::string code): main(new Program) {
+    // (compiled by a Snowman that's only used for this)
+    Snowman sm;
+    if (!sm.compile(code, *main)) {
+        delete main;
+        main = nullptr;
+        return;
+    }
+    // a block that can't be compiled is left to fail when it's run, like it
+    //   would otherwise
+    std::ostringstream ignored;
+    sm.err = &ignored;
+    addBlocks(sm, *main);
+}
+
+Script::~Script() {
+    delete main;
+    for (auto& b : blocks) delete b.second;
+}
+
+void Script::addBlocks(Snowman& sm, const Program& prog) {
+    for (const Instruction& ins : prog.instructions) {
+        if (ins.type != Instruction::BLOCK || blocks.count(ins.str)) continue;
+        Program* p = new Program;
+        if (!sm.compile(ins.str, *p)) {
+            delete p;
+            continue;
+        }
+        blocks[ins.str] = p;
+        addBlocks(sm, *p);
+    }
+}
+
+// copy a program (of a Script) with this Snowman's own values for its
+// literals; it still has to be inferred, since that depends on the state it's
+// first run in
+void Snowman::instantiate(const Program& from, Program& to) {
+    to.instructions = from.instructions;
+    for (Instruction& ins : to.instructions) intern(ins, to.constants);
+    to.locations = from.locations;
+    to.permavarCount = from.permavarCount;
+    if (to.permavarCount > permavars.size()) permavars.resize(to.permavarCount);
+}
+
+void Snowman::batch(std::vector<BatchJob>& jobs, unsigned threads,
+        const Snowman& settings) {
+    // (the arguments are made again from their text for every job, and the
+    //   seeds are all drawn up front, so that which thread a job ends up on
+    //   doesn't change anything)
+    std::vector<std::string> args;
+    for (const Variable& a : settings.args) {
+        args.push_back(arrToString(*a.arrayVal));
+    }
+    Random random = settings.random;
+    std::vector<unsigned long long> seeds;
+    for (vvs i = 0; i < jobs.size(); ++i) seeds.push_back(random.next());
+
+    std::atomic<vvs> next(0);
+    auto work = [&]() {
+        for (vvs i; (i = next++) < jobs.size();) {
+            BatchJob& job = jobs[i];
+            auto started = std::chrono::steady_clock::now();
+            std::ifstream in(job.input.c_str());
+            std::ostringstream out, err;
+            if (!job.script->main) {
+                err << "Could not compile script" << std::endl;
+            } else if (!in.good()) {
+                err << "Could not read file " << job.input << std::endl;
+            } else {
+                Snowman sm;
+                sm.in = &in;
+                sm.out = &out;
+                sm.err = &err;
+                sm.setMaxDepth(settings.frames.size() - 1);
+                sm.seed(seeds[i]);
+                for (const std::string& a : args) sm.addArg(a);
+                sm.debugOutput = settings.debugOutput;
+                sm.debugItems = settings.debugItems;
+                sm.debugDepth = settings.debugDepth;
+                sm.debugElide = settings.debugElide;
+                sm.instructionLimit = settings.instructionLimit;
+                sm.timeLimit = settings.timeLimit;
+                sm.memoryLimit = settings.memoryLimit;
+                sm.limitDump = settings.limitDump;
+                sm.jitThreshold = settings.jitThreshold;
+                // (one job running out of memory shouldn't take the others
+                //   down with it)
+                try {
+                    sm.run(*job.script);
+                } catch (const std::exception& e) {
+                    err << "Job stopped: " << e.what() << std::endl;
+                }
+                std::ofstream file(job.output.c_str());
+                file << out.str();
+                if (!file.good()) {
+                    err << "Could not write file " << job.output << std::endl;
+                }
+            }
+            job.errors = err.str();
+            job.milliseconds = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - started).count();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads && t < jobs.size(); ++t) {
+        pool.push_back(std::thread(work));
+    }
+    for (std::thread& t : pool) t.join();
+}
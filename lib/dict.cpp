@@ -0,0 +1,88 @@
+#include "snowman.hpp"
+// included from snowman.hpp: <vector>
+
+// the hash table behind dictionaries (see tDict in snowman.hpp). the table
+// only holds indices, so growing it doesn't move any keys or values, and the
+// hash of every entry is kept next to it, so neither does rebuilding it.
+// deletion shifts later entries of a probe sequence back into the freed slot
+// ("backward shift deletion") instead of leaving a tombstone.
+//
+// keys and values are held with a reference each (set is given shared ones),
+// which keeps their arrays from being modified in place while they're in a
+// dictionary, and so keeps the hashes right. they're never released again,
+// the same as the elements of arrays.
+
+const Variable* tDict::get(const Variable& key) const {
+    if (live == 0) return nullptr;
+    unsigned e = table[find(key, equalHash(key))];
+    return e ? &entries[e - 1].value : nullptr;
+}
+
+void tDict::set(const Variable& key, const Variable& value) {
+    // (the table is kept at most 3/4 full, and at least twice the size of
+    //   what it holds after a rebuild)
+    if ((live + 1) * 4 > table.size() * 3) {
+        size_t capacity = 8;
+        while (capacity < (live + 1) * 2) capacity *= 2;
+        rebuild(capacity);
+    }
+    size_t hash = equalHash(key), slot = find(key, hash);
+    if (table[slot]) {
+        entries[table[slot] - 1].value = value;
+        return;
+    }
+    entries.push_back(Entry{key, value, hash});
+    table[slot] = entries.size();
+    ++live;
+}
+
+bool tDict::erase(const Variable& key) {
+    if (live == 0) return false;
+    size_t mask = table.size() - 1, i = find(key, equalHash(key));
+    if (!table[i]) return false;
+    entries[table[i] - 1].key = Variable();
+    --live;
+
+    // anything further along the probe sequence that would have been put in
+    //   the freed slot (if it had been free) is moved back into it, which
+    //   frees its own slot in turn
+    for (size_t j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
+        size_t home = entries[table[j] - 1].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i] = 0;
+
+    // (holes are only cleared out once there are more of them than entries)
+    if (entries.size() > 2 * live + 8) rebuild(table.size());
+    return true;
+}
+
+size_t tDict::find(const Variable& key, size_t hash) const {
+    size_t mask = table.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        unsigned e = table[i];
+        if (!e) return i;
+        const Entry& entry = entries[e - 1];
+        if (entry.hash == hash && equal(entry.key, key)) return i;
+    }
+}
+
+void tDict::rebuild(size_t capacity) {
+    vvs n = 0;
+    for (vvs i = 0; i < entries.size(); ++i) {
+        if (entries[i].key.type != Variable::UNDEFINED) {
+            entries[n++] = entries[i];
+        }
+    }
+    entries.resize(n);
+    table.assign(capacity, 0);
+    size_t mask = capacity - 1;
+    for (vvs e = 0; e < n; ++e) {
+        size_t i = entries[e].hash & mask;
+        while (table[i]) i = (i + 1) & mask;
+        table[i] = e + 1;
+    }
+}
@@ -0,0 +1,139 @@
+#include "snowman.hpp"
+#include <sstream>    // std::ostringstream
+#include <cstdio>     // sprintf
+// included from snowman.hpp: <vector>, <string>, <map>
+
+// translation of a Snowman program into C++ (--emit-cpp). every block literal
+// becomes a C++ function, which the runtime calls instead of interpreting the
+// block (see Snowman::addTranslatedBlock). variable rotations and active
+// variable toggles are written out as plain C++; every other instruction is
+// decoded once at startup and handed straight to the interpreter's operator
+// implementation, so the generated program never tokenizes or dispatches on
+// strings while it runs.
+//
+// the result has to be compiled together with the interpreter sources (every
+// file in lib except main.cpp, with -pthread like the Makefile), ex.
+//   g++ -O3 -std=c++11 -pthread -Ilib prog.cpp $(ls lib/*.cpp | grep -v main)
+
+namespace {
+
+// C++ string literal (octal escapes, so nothing can run into the next char)
+std::string quote(const std::string& s) {
+    std::ostringstream out;
+    out << "std::string(\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c >= ' ' && c <= '~' && c != '?') {
+            // (? is escaped too, because of trigraphs)
+            out << c;
+        } else {
+            char buf[5];
+            sprintf(buf, "\\%03o", (unsigned char)c);
+            out << buf;
+        }
+    }
+    out << "\", " << s.length() << ")";
+    return out.str();
+}
+
+// see the ROT2/ROT3/TOG_ACT macros in snowman.cpp
+std::string rotation(char op) {
+    switch (op) {
+    case '/': return "std::swap(v[2], v[5]);";
+    case '\\': return "std::swap(v[0], v[7]);";
+    case '_': return "std::swap(v[5], v[7]);";
+    case '[': return "std::swap(v[0], v[5]);";
+    case ']': return "std::swap(v[2], v[7]);";
+    case '|': return "std::swap(v[1], v[6]);";
+    case '-': return "std::swap(v[3], v[4]);";
+    case '\'': return "std::swap(v[1], v[3]);";
+    case '`': return "std::swap(v[1], v[4]);";
+    case ',': return "std::swap(v[4], v[6]);";
+    case '.': return "std::swap(v[3], v[6]);";
+    case '^': return "Variable t = v[1]; v[1] = v[3]; v[3] = v[4]; v[4] = t;";
+    case '>': return "Variable t = v[5]; v[5] = v[4]; v[4] = v[0]; v[0] = t;";
+    case '<': return "Variable t = v[2]; v[2] = v[3]; v[3] = v[7]; v[7] = t;";
+    default: return "";
+    }
+}
+
+std::string toggle(char op) {
+    switch (op) {
+    case '(': return "a[0] = !a[0]; a[5] = !a[5];";
+    case ')': return "a[2] = !a[2]; a[7] = !a[7];";
+    case '{': return "a[1] = !a[1]; a[3] = !a[3]; a[6] = !a[6];";
+    case '}': return "a[1] = !a[1]; a[4] = !a[4]; a[6] = !a[6];";
+    case '~': return "for (int i = 0; i < 8; ++i) a[i] = !a[i];";
+    case '?': return "for (int i = 0; i < 8; ++i) a[i] = false;";
+    default: return "";
+    }
+}
+
+}
+
+// write out a C++ function for a string of code (and for every block literal
+// inside it, which also get recorded in blocks); returns the function's number
+vvs Snowman::emitFunction(std::string code, std::vector<std::string>& tokens,
+        std::vector<std::string>& functions, std::map<std::string, vvs>& blocks) {
+    vvs n = functions.size();
+    functions.push_back("");
+    std::ostringstream fn;
+    fn << "bool fn" << n << "(Snowman& sm) {\n";
+    for (std::string token : tokenize(code)) {
+        Instruction ins = decode(token);
+        if (ins.type == Instruction::OPERATOR && ins.op < 128 &&
+                !rotation(ins.op).empty()) {
+            fn << "    { Variable* v = sm.variables(); " << rotation(ins.op) <<
+                " }\n";
+        } else if (ins.type == Instruction::OPERATOR && ins.op < 128 &&
+                !toggle(ins.op).empty()) {
+            fn << "    { bool* a = sm.active(); " << toggle(ins.op) << " }\n";
+        } else {
+            if (ins.type == Instruction::BLOCK && !blocks.count(ins.str)) {
+                // (identical blocks share a function)
+                vvs blk = emitFunction(ins.str, tokens, functions, blocks);
+                blocks[ins.str] = blk;
+            }
+            fn << "    if (!sm.exec(I[" << tokens.size() << "])) return false;";
+            if (ins.type == Instruction::OPERATOR) fn << "  // " << token;
+            if (ins.type == Instruction::BLOCK) {
+                fn << "  // fn" << blocks[ins.str];
+            }
+            fn << "\n";
+            tokens.push_back(token);
+        }
+    }
+    fn << "    return true;\n}\n";
+    functions[n] = fn.str();
+    return n;
+}
+
+std::string Snowman::emitCpp(std::string code) {
+    std::vector<std::string> tokens, functions;
+    std::map<std::string, vvs> blocks;
+    emitFunction(code, tokens, functions, blocks);
+
+    std::ostringstream out;
+    out << "// generated by snowman --emit-cpp; compile together with every "
+        "file in\n// snowman's lib directory except main.cpp, with -pthread\n"
+        "#include \"snowman.hpp\"\n#include <utility>\n\n"
+        "namespace {\n\nstd::vector<Instruction> I;\n\n";
+    for (const std::string& fn : functions) out << fn << "\n";
+    out << "}\n\n"
+        "int main(int argc, char *argv[]) {\n"
+        "    Snowman sm;\n"
+        "    for (int i = 1; i < argc; ++i) sm.addArg(argv[i]);\n\n";
+    for (const std::string& token : tokens) {
+        out << "    I.push_back(sm.instruction(" << quote(token) << "));\n";
+    }
+    out << "\n";
+    // block literals are matched to their functions by their code (which is
+    // what the BLOCK instruction stores)
+    for (const auto& blk : blocks) {
+        out << "    sm.addTranslatedBlock(" << quote(blk.first) << ", fn" <<
+            blk.second << ");\n";
+    }
+    out << "\n    fn0(sm);\n}\n";
+    return out.str();
+}
@@ -0,0 +1,184 @@
+#include "snowman.hpp"
+#include <unordered_set>  // std::unordered_set
+// included from snowman.hpp: <vector>, <string>, <map>, <unordered_map>
+
+// heap accounting (see Heap in snowman.hpp). arrays, blocks and dictionaries
+// are counted by their own operator new and delete, which keeps stack
+// temporaries out of it. bytes are counted by the global operator new and
+// delete, in builds that replace them (see alloc.cpp), so they include
+// everything allocated on the thread (the vectors inside values most of all),
+// which is what the memory limit goes by. nothing is counted unless a Heap is
+// current, and values and sites only while it's tracking them (with memStats)
+//
+// since arrays and dictionaries never release their elements, an array that's
+// deleted can leave the ones inside it behind with nothing pointing to them.
+// unreachable finds those by marking everything that can still be reached
+// and looking at what's left
+
+thread_local Heap* Heap::current = nullptr;
+
+void Heap::add(const void* p, Kind kind) {
+    // (the bookkeeping itself allocates, which isn't counted)
+    current = nullptr;
+    auto s = site();
+    ++s->second.values;
+    live[p] = Value{kind, &s->first};
+    values[kind].add(1);
+    current = this;
+}
+
+void Heap::remove(const void* p) {
+    auto v = live.find(p);
+    // (it's from before this Heap was current)
+    if (v == live.end()) return;
+    current = nullptr;
+    values[v->second.kind].add(-1);
+    live.erase(v);
+    current = this;
+}
+
+std::map<std::string, Heap::Site>::iterator Heap::site() {
+    if (!sited || siteAt != at) {
+        Heap* h = current;
+        current = nullptr;
+        std::string name = !at ? "(no instruction)" :
+            at->type == Instruction::OPERATOR ? at->token :
+            at->type == Instruction::STRING ? "(string literal)" :
+            at->type == Instruction::BLOCK ? "(block literal)" :
+            "(other)";
+        siteOf = sites.insert(std::make_pair(name, Site())).first;
+        siteAt = at;
+        sited = true;
+        current = h;
+    }
+    return siteOf;
+}
+
+std::map<std::string, Heap::Site> Snowman::unreachable() {
+    // (none of this is counted)
+    Heap* h = Heap::current;
+    Heap::current = nullptr;
+
+    std::unordered_set<const void*> reached;
+    std::vector<Variable> pending;
+    for (vvs d = 0; d <= peakDepth; ++d) {
+        pending.insert(pending.end(), frames[d].vars, frames[d].vars + 8);
+    }
+    pending.insert(pending.end(), permavars.begin(), permavars.end());
+    pending.insert(pending.end(), args.begin(), args.end());
+    for (auto& c : constants) pending.push_back(c.second);
+
+    while (!pending.empty()) {
+        Variable v = pending.back();
+        pending.pop_back();
+        switch (v.type) {
+        case Variable::ARRAY:
+            if (!reached.insert(v.arrayVal).second) break;
+            pending.insert(pending.end(), v.arrayVal->begin(),
+                v.arrayVal->end());
+            if (v.arrayVal->source) pending.push_back(v.arrayVal->source);
+            break;
+        case Variable::BLOCK:
+            if (!reached.insert(v.blockVal).second) break;
+            if (v.blockVal->program) {
+                for (auto& c : v.blockVal->program->constants) {
+                    pending.push_back(c.second);
+                }
+            }
+            break;
+        case Variable::DICT:
+            if (!reached.insert(v.dictVal).second) break;
+            // (holes still hold on to their values)
+            for (auto& e : v.dictVal->entries) {
+                pending.push_back(e.key);
+                pending.push_back(e.value);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    std::map<std::string, Heap::Site> lost;
+    for (auto& v : heap.live) {
+        if (reached.count(v.first)) continue;
+        Heap::Site& s = lost[*v.second.site];
+        ++s.values;
+        switch (v.second.kind) {
+        case Heap::ARRAY: s.bytes += ((const tArray*)v.first)->bytes(); break;
+        case Heap::BLOCK: s.bytes += ((const tBlock*)v.first)->bytes(); break;
+        case Heap::DICT: s.bytes += ((const tDict*)v.first)->bytes(); break;
+        }
+    }
+    Heap::current = h;
+    return lost;
+}
+
+// a row of memoryReport: a label, then every cell right-aligned in a column
+static std::string row(std::string label,
+        const std::vector<std::string>& cells) {
+    label.resize(std::max<size_t>(label.length(), 16), ' ');
+    for (const std::string& c : cells) {
+        label += std::string(c.length() < 12 ? 12 - c.length() : 1, ' ') + c;
+    }
+    return label + "\n";
+}
+
+static std::string row(std::string label, unsigned long long a,
+        unsigned long long b) {
+    return row(label, {std::to_string(a), std::to_string(b)});
+}
+
+static std::string row(std::string label, long long a, long long b,
+        unsigned long long c) {
+    return row(label, {std::to_string(a), std::to_string(b),
+        std::to_string(c)});
+}
+
+std::string Snowman::memoryReport() {
+    std::map<std::string, Heap::Site> lost = unreachable();
+    Heap* h = Heap::current;
+    Heap::current = nullptr;
+
+    std::string out = row("", {"live", "peak", "total"});
+    const char* kinds[] = {"arrays", "blocks", "dictionaries"};
+    for (int k = 0; k < 3; ++k) {
+        out += row(kinds[k], heap.values[k].live, heap.values[k].peak,
+            heap.values[k].total);
+    }
+    // (bytes freed that were allocated before the Heap was current can make
+    //   the live count look smaller than it is)
+    if (Heap::countsBytes) {
+        out += row("bytes", std::max(heap.bytes.live, 0LL), heap.bytes.peak,
+            heap.bytes.total);
+    }
+
+    // (the operators that allocated the most bytes first)
+    std::vector<std::pair<std::string, Heap::Site>> sites(heap.sites.begin(),
+        heap.sites.end());
+    std::sort(sites.begin(), sites.end(),
+        [](const std::pair<std::string, Heap::Site>& a,
+                const std::pair<std::string, Heap::Site>& b) {
+            return a.second.bytes != b.second.bytes ?
+                a.second.bytes > b.second.bytes :
+                a.second.values > b.second.values;
+        });
+    out += row("allocated by", {"values", "bytes"});
+    for (auto& s : sites) {
+        out += row(s.first, s.second.values, s.second.bytes);
+    }
+
+    unsigned long long values = 0, bytes = 0;
+    for (auto& s : lost) {
+        values += s.second.values;
+        bytes += s.second.bytes;
+    }
+    out += row("unreachable", {"values", "bytes"});
+    for (auto& s : lost) {
+        out += row(s.first, s.second.values, s.second.bytes);
+    }
+    out += row("(all)", values, bytes);
+
+    Heap::current = h;
+    return out;
+}
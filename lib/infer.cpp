@@ -0,0 +1,540 @@
+#include "snowman.hpp"
+#include <cmath>      // floor, ceil, round, pow
+// included from snowman.hpp: <vector>, <string>, <cstring>
+
+#define HSH1(a) ((long)a)
+#define HSH2(a,b) (((long)a)*256 + ((long)b))
+#define HSH3(a,b,c) (((long)a)*256*256 + ((long)b)*256 + ((long)c))
+
+// static inference of which variables are active and what each variable
+// holds, through a compiled program. it starts from the state the program is
+// first run in, and follows it for as long as that can be known (running a
+// block, for instance, could do anything, so it stops there).
+//
+// wherever that proves which variables a number operator takes its arguments
+// from and stores its result in, and that the arguments are numbers, the
+// instruction is marked typed: execute then runs it without retrieve, store
+// or any of their checks. that only holds if the program starts out the same
+// way again, so execute checks the active variables and their types first
+// (like the JIT, which checks the active variables).
+//
+// the same pass finds errors that are certain to happen, which --check
+// reports without running anything.
+
+namespace {
+
+const int ANY = -1; // type of a variable that could hold anything
+
+// what an operator takes and gives back, as in the comments in evalToken:
+// n = number, a = array, b = block, d = dictionary, * = anything (results: also - = nothing
+// and 2 = two copies of the argument)
+struct Signature {
+    long op;
+    const char* args;
+    char result;
+    enum { PURE, FALLIBLE, BLOCKS } kind;
+    // PURE operators always store their result once they have their
+    //   arguments, and don't touch anything else; FALLIBLE ones might not
+    //   store it; BLOCKS ones run blocks, which can do anything
+};
+
+const Signature SIGNATURES[] = {
+    {HSH3('N','D','E'), "n", 'n', Signature::PURE},
+    {HSH3('N','I','N'), "n", 'n', Signature::PURE},
+    {HSH3('N','A','B'), "n", 'n', Signature::PURE},
+    {HSH2('n','f'), "n", 'n', Signature::PURE},
+    {HSH2('n','c'), "n", 'n', Signature::PURE},
+    {HSH3('N','R','O'), "n", 'n', Signature::PURE},
+    {HSH3('N','B','N'), "n", 'n', Signature::PURE},
+    {HSH3('N','B','O'), "nn", 'n', Signature::PURE},
+    {HSH3('N','B','A'), "nn", 'n', Signature::PURE},
+    {HSH3('N','B','X'), "nn", 'n', Signature::PURE},
+    {HSH2('n','a'), "nn", 'n', Signature::PURE},
+    {HSH2('n','s'), "nn", 'n', Signature::PURE},
+    {HSH2('n','m'), "nn", 'n', Signature::PURE},
+    {HSH2('n','d'), "nn", 'n', Signature::PURE},
+    {HSH3('N','M','O'), "nn", 'n', Signature::PURE},
+    {HSH2('n','l'), "nn", 'n', Signature::PURE},
+    {HSH2('n','g'), "nn", 'n', Signature::PURE},
+    {HSH2('n','r'), "nn", 'a', Signature::PURE},
+    {HSH2('n','p'), "nn", 'n', Signature::PURE},
+    {HSH2('n','b'), "nn", 'a', Signature::FALLIBLE},
+    {HSH3('N','R','A'), "n", 'a', Signature::PURE},
+    {HSH3('A','S','O'), "a", 'a', Signature::FALLIBLE},
+    {HSH3('A','S','B'), "ab", '-', Signature::BLOCKS},
+    {HSH2('a','f'), "ab", '-', Signature::BLOCKS},
+    {HSH2('a','c'), "aa", 'a', Signature::FALLIBLE},
+    {HSH2('a','d'), "aa", 'a', Signature::FALLIBLE},
+    {HSH3('A','O','R'), "aa", 'a', Signature::FALLIBLE},
+    {HSH3('A','A','N'), "aa", 'a', Signature::FALLIBLE},
+    {HSH2('a','r'), "an", 'a', Signature::FALLIBLE},
+    {HSH2('a','j'), "aa", 'a', Signature::FALLIBLE},
+    {HSH2('a','s'), "aa", 'a', Signature::FALLIBLE},
+    {HSH2('a','g'), "an", 'a', Signature::FALLIBLE},
+    {HSH2('a','e'), "ab", '-', Signature::BLOCKS},
+    {HSH2('a','m'), "ab", '-', Signature::BLOCKS},
+    {HSH2('a','n'), "an", 'a', Signature::FALLIBLE},
+    {HSH3('A','S','E'), "ab", '-', Signature::BLOCKS},
+    {HSH3('A','S','I'), "ab", '-', Signature::BLOCKS},
+    {HSH3('A','A','L'), "an", 'a', Signature::FALLIBLE},
+    {HSH3('A','A','G'), "an", 'a', Signature::FALLIBLE},
+    {HSH2('a','a'), "an", '*', Signature::FALLIBLE},
+    {HSH2('a','l'), "a", 'n', Signature::PURE},
+    {HSH2('a','z'), "a", 'a', Signature::FALLIBLE},
+    {HSH3('A','S','P'), "anna", 'a', Signature::FALLIBLE},
+    {HSH3('A','F','L'), "an", 'a', Signature::FALLIBLE},
+    {HSH3('A','S','H'), "a", 'a', Signature::FALLIBLE},
+    {HSH2('s','b'), "an", 'n', Signature::FALLIBLE},
+    {HSH2('s','p'), "a", '-', Signature::FALLIBLE},
+    {HSH2('s','m'), "aa", 'a', Signature::FALLIBLE},
+    {HSH2('s','r'), "aaa", 'a', Signature::FALLIBLE},
+    {HSH3('S','R','B'), "aab", '-', Signature::BLOCKS},
+    {HSH2('d','g'), "d*", '*', Signature::PURE},
+    {HSH2('d','s'), "d**", 'd', Signature::PURE},
+    {HSH2('d','d'), "d*", 'd', Signature::PURE},
+    {HSH2('d','h'), "d*", 'n', Signature::PURE},
+    {HSH2('d','k'), "d", 'a', Signature::PURE},
+    {HSH2('d','v'), "d", 'a', Signature::PURE},
+    {HSH2('d','l'), "d", 'n', Signature::PURE},
+    {HSH2('b','r'), "bn", '-', Signature::BLOCKS},
+    {HSH2('b','w'), "bb", '-', Signature::BLOCKS},
+    {HSH2('b','i'), "bb*", '-', Signature::BLOCKS},
+    {HSH2('b','d'), "b", '-', Signature::BLOCKS},
+    {HSH2('b','e'), "b", '-', Signature::BLOCKS},
+    {HSH2('n','o'), "*", 'n', Signature::PURE},
+    {HSH2('w','r'), "*", 'a', Signature::PURE},
+    {HSH2('t','s'), "*", 'a', Signature::PURE},
+    {HSH2('b','o'), "**", 'n', Signature::PURE},
+    {HSH2('o','r'), "**", 'n', Signature::PURE},
+    {HSH2('e','q'), "**", 'n', Signature::PURE},
+    {HSH2('d','u'), "*", '2', Signature::PURE},
+    {HSH2('v','n'), "", '-', Signature::PURE},
+    {HSH2('v','g'), "", 'a', Signature::PURE},
+    {HSH2('v','r'), "", 'n', Signature::PURE},
+    {HSH2('v','t'), "", 'n', Signature::PURE},
+    {HSH2('v','a'), "", 'a', Signature::PURE},
+    {HSH2('v','d'), "", 'd', Signature::PURE}
+};
+
+int typeOf(char c) {
+    switch (c) {
+    case 'n': return Variable::NUM;
+    case 'a': return Variable::ARRAY;
+    case 'b': return Variable::BLOCK;
+    case 'd': return Variable::DICT;
+    default: return ANY;
+    }
+}
+
+// the operators that can be typed: the ones that only compute a number from
+// one or two numbers
+bool typeable(long op) {
+    switch (op) {
+    case HSH3('N','D','E'): case HSH3('N','I','N'): case HSH3('N','A','B'):
+    case HSH2('n','f'): case HSH2('n','c'): case HSH3('N','R','O'):
+    case HSH3('N','B','N'): case HSH3('N','B','O'): case HSH3('N','B','A'):
+    case HSH3('N','B','X'): case HSH2('n','a'): case HSH2('n','s'):
+    case HSH2('n','m'): case HSH2('n','d'): case HSH3('N','M','O'):
+    case HSH2('n','l'): case HSH2('n','g'): case HSH2('n','p'):
+        return true;
+    default:
+        return false;
+    }
+}
+
+// see ROT2/ROT3 in snowman.cpp (c is -1 for ROT2)
+struct Rotation { long op; int a, b, c; };
+const Rotation ROTATIONS[] = {
+    {HSH1('/'), 2, 5, -1}, {HSH1('\\'), 0, 7, -1}, {HSH1('_'), 5, 7, -1},
+    {HSH1('['), 0, 5, -1}, {HSH1(']'), 2, 7, -1}, {HSH1('|'), 1, 6, -1},
+    {HSH1('-'), 3, 4, -1}, {HSH1('\''), 1, 3, -1}, {HSH1('`'), 1, 4, -1},
+    {HSH1(','), 4, 6, -1}, {HSH1('.'), 3, 6, -1}, {HSH1('^'), 1, 3, 4},
+    {HSH1('>'), 5, 4, 0}, {HSH1('<'), 2, 3, 7}
+};
+
+struct Inference {
+    bool known;         // whether active is known (types can still be ANY)
+    bool active[8];
+    int types[8];
+    bool savedKnown;    // the `$' state (which is shared by every frame)
+    bool saved[8];
+    bool topLevel;      // whether there's no frame to return to with `))'
+    int permavar;       // type of the current permavar
+
+    // the frames of the subroutines that were entered
+    struct Frame { bool active[8]; int types[8]; };
+    std::vector<Frame> frames;
+
+    std::vector<std::string>* errors;
+
+    void error(const Instruction& ins, vvs i, const std::string& msg) {
+        if (!errors) return;
+        errors->push_back("token " + std::to_string(i + 1) + " (" +
+            ins.token + "): " + msg);
+    }
+
+    // the variable a value would be stored in (-1 if it would be dropped), or
+    // -2 if that isn't certain
+    int destination() {
+        for (int i = 0; i < 8; ++i) {
+            if (!active[i]) continue;
+            if (types[i] == Variable::UNDEFINED) return i;
+            if (types[i] == ANY) return -2;
+        }
+        return -1;
+    }
+
+    void store(int type) {
+        for (int i = 0; i < 8; ++i) {
+            if (!active[i]) continue;
+            if (types[i] == Variable::UNDEFINED) {
+                types[i] = type;
+                return;
+            }
+            if (types[i] == ANY) {
+                // (it's stored either here or in some later variable that's
+                //   undefined, up to the first one that's certainly so)
+                for (int j = i + 1; j < 8; ++j) {
+                    if (active[j] && types[j] == Variable::UNDEFINED) {
+                        types[j] = ANY;
+                        return;
+                    }
+                }
+                return;
+            }
+        }
+    }
+
+    void forget() {
+        for (int i = 0; i < 8; ++i) if (active[i]) types[i] = ANY;
+    }
+
+    void rotateActive() {
+        bool b = active[0]; active[0] = active[3]; active[3] = active[5];
+        active[5] = active[6]; active[6] = active[7]; active[7] = active[4];
+        active[4] = active[2]; active[2] = active[1]; active[1] = b;
+    }
+
+    void operate(Instruction& ins, vvs idx, const Signature& sig) {
+        int act[8], n = 0;
+        for (int i = 0; i < 8; ++i) if (active[i]) act[n++] = i;
+        int nargs = strlen(sig.args);
+
+        // the arguments are the first active variables, in order; k is the
+        //   first one that's certainly wrong (nargs if none is), unless one
+        //   before it only might be
+        int k = 0;
+        bool certain = true;
+        for (; k < nargs && k < n; ++k) {
+            int t = types[act[k]], want = typeOf(sig.args[k]);
+            if (t == ANY) {
+                certain = false;
+                break;
+            }
+            if (t == Variable::UNDEFINED || (want != ANY && t != want)) break;
+        }
+        if (certain && k == n && k < nargs) {
+            error(ins, idx, "not enough variables");
+            known = false;
+            return;
+        }
+        if (!certain) {
+            forget();
+            if (sig.kind == Signature::BLOCKS) known = false;
+            return;
+        }
+        // (du stores copies of its argument, even if that was consumed)
+        int copied = n > 0 ? types[act[0]] : ANY;
+        if (ins.consume) {
+            for (int i = 0; i < k; ++i) types[act[i]] = Variable::UNDEFINED;
+        }
+        if (k < nargs) {
+            error(ins, idx, "wrong type");
+            return;
+        }
+
+        if (sig.kind == Signature::BLOCKS) {
+            known = false;
+            return;
+        }
+        if (sig.kind == Signature::PURE && typeable(ins.op)) {
+            int dest = destination();
+            if (dest != -2) {
+                ins.typed = true;
+                ins.args[0] = act[0];
+                ins.args[1] = nargs == 2 ? act[1] : -1;
+                ins.dest = dest;
+            }
+        }
+        if (sig.result == '-') return;
+        if (sig.kind == Signature::FALLIBLE) {
+            store(ANY);
+        } else if (sig.result == '2') {
+            store(copied);
+            store(copied);
+        } else {
+            store(typeOf(sig.result));
+        }
+    }
+
+    void step(Instruction& ins, vvs idx) {
+        switch (ins.type) {
+        case Instruction::NUMBER: {
+            int dest = destination();
+            if (ins.error.empty() && dest != -2) {
+                ins.typed = true;
+                ins.dest = dest;
+            }
+            store(Variable::NUM);
+            if (!ins.error.empty()) error(ins, idx, ins.error);
+            return;
+        }
+        case Instruction::STRING:
+            store(Variable::ARRAY);
+            return;
+        case Instruction::BLOCK:
+            store(Variable::BLOCK);
+            return;
+        case Instruction::PERMAVAR:
+            permavar = ANY;
+            return;
+        case Instruction::SUB_START: {
+            Frame f;
+            std::memcpy(f.active, active, sizeof(active));
+            std::memcpy(f.types, types, sizeof(types));
+            frames.push_back(f);
+            for (int i = 0; i < 8; ++i) {
+                active[i] = false;
+                types[i] = Variable::UNDEFINED;
+            }
+            return;
+        }
+        case Instruction::SUB_END:
+            if (frames.empty()) {
+                if (topLevel) {
+                    error(ins, idx, "no subroutines left on stack");
+                } else {
+                    known = false;
+                }
+                return;
+            }
+            std::memcpy(active, frames.back().active, sizeof(active));
+            std::memcpy(types, frames.back().types, sizeof(types));
+            frames.pop_back();
+            return;
+        case Instruction::INVALID:
+            error(ins, idx, ins.error);
+            if (ins.fatal) known = false;
+            return;
+        case Instruction::OPERATOR:
+            break;
+        }
+
+        for (const Rotation& r : ROTATIONS) {
+            if (r.op != ins.op) continue;
+            int t = types[r.a];
+            if (r.c == -1) {
+                types[r.a] = types[r.b];
+                types[r.b] = t;
+            } else {
+                types[r.a] = types[r.b];
+                types[r.b] = types[r.c];
+                types[r.c] = t;
+            }
+            return;
+        }
+        for (const Signature& sig : SIGNATURES) {
+            if (sig.op == ins.op) {
+                operate(ins, idx, sig);
+                return;
+            }
+        }
+
+        switch (ins.op) {
+        case HSH1('('): active[0] = !active[0]; active[5] = !active[5]; return;
+        case HSH1(')'): active[2] = !active[2]; active[7] = !active[7]; return;
+        case HSH1('{'):
+            active[1] = !active[1]; active[3] = !active[3];
+            active[6] = !active[6];
+            return;
+        case HSH1('}'):
+            active[1] = !active[1]; active[4] = !active[4];
+            active[6] = !active[6];
+            return;
+        case HSH1('~'):
+            for (int i = 0; i < 8; ++i) active[i] = !active[i];
+            return;
+        case HSH1('@'):
+            rotateActive();
+            return;
+        case HSH1('%'):
+            for (int i = 0; i < 4; ++i) rotateActive();
+            return;
+        case HSH1('?'):
+            for (int i = 0; i < 8; ++i) active[i] = false;
+            return;
+        case HSH1('$'):
+            std::memcpy(saved, active, sizeof(saved));
+            savedKnown = true;
+            return;
+        case HSH1('&'):
+            if (!savedKnown) {
+                known = false;
+                return;
+            }
+            std::memcpy(active, saved, sizeof(active));
+            return;
+        case HSH1('*'): {
+            // (the first active variable that holds anything)
+            for (int i = 0; i < 8; ++i) {
+                if (!active[i] || types[i] == Variable::UNDEFINED) continue;
+                permavar = types[i];
+                if (types[i] == ANY) forget();
+                else types[i] = Variable::UNDEFINED;
+                return;
+            }
+            error(ins, idx, "not enough variables");
+            known = false;
+            return;
+        }
+        case HSH1('#'):
+            // (storing an undefined value doesn't change anything)
+            if (permavar != Variable::UNDEFINED) store(permavar);
+            return;
+        default:
+            known = false;
+            return;
+        }
+    }
+
+    void run(std::vector<Instruction>& ins) {
+        for (vvs i = 0; known && i < ins.size(); ++i) step(ins[i], i);
+    }
+};
+
+// (must match the operators in evalToken, as long as the numbers and the
+// result are below 2^53)
+tNum typedResult(long op, tNum a, tNum b) {
+    switch (op) {
+    case HSH3('N','D','E'): return a - 1;
+    case HSH3('N','I','N'): return a + 1;
+    case HSH3('N','A','B'): return a < 0 ? -a : a;
+    case HSH2('n','f'): return floor(a);
+    case HSH2('n','c'): return ceil(a);
+    case HSH3('N','R','O'): return round(a);
+    case HSH3('N','B','N'): return (tNum) ~toInt(a);
+    case HSH3('N','B','O'): return (tNum) (toInt(a) | toInt(b));
+    case HSH3('N','B','A'): return (tNum) (toInt(a) & toInt(b));
+    case HSH3('N','B','X'): return (tNum) (toInt(a) ^ toInt(b));
+    case HSH2('n','a'): return a + b;
+    case HSH2('n','s'): return a - b;
+    case HSH2('n','m'): return a * b;
+    case HSH2('n','d'): return a / b;
+    case HSH3('N','M','O'): return modulo(a, b);
+    case HSH2('n','l'): return a < b;
+    case HSH2('n','g'): return a > b;
+    default /* np */: return pow(a, b);
+    }
+}
+
+// (and otherwise, given what typedResult gave; see arith)
+Variable typedExact(long op, tNum a, int aLow, tNum b, int bLow, tNum r) {
+    switch (op) {
+    case HSH3('N','D','E'): return exactArith('-', a, aLow, 1, 0, r);
+    case HSH3('N','I','N'): return exactArith('+', a, aLow, 1, 0, r);
+    case HSH3('N','A','B'):
+        return a < 0 ? exactArith('-', 0, 0, a, aLow, r) : Variable(a, aLow);
+    case HSH2('n','f'): case HSH2('n','c'): case HSH3('N','R','O'):
+        return Variable(r, aLow);
+    case HSH3('N','B','N'): return exactNum(~toInt(a, aLow));
+    case HSH3('N','B','O'): return exactNum(toInt(a, aLow) | toInt(b, bLow));
+    case HSH3('N','B','A'): return exactNum(toInt(a, aLow) & toInt(b, bLow));
+    case HSH3('N','B','X'): return exactNum(toInt(a, aLow) ^ toInt(b, bLow));
+    case HSH2('n','a'): return exactArith('+', a, aLow, b, bLow, r);
+    case HSH2('n','s'): return exactArith('-', a, aLow, b, bLow, r);
+    case HSH2('n','m'): return exactArith('*', a, aLow, b, bLow, r);
+    case HSH3('N','M','O'): return exactArith('%', a, aLow, b, bLow, r);
+    case HSH2('n','l'): return Variable((tNum)numLess(a, aLow, b, bLow));
+    case HSH2('n','g'): return Variable((tNum)numLess(b, bLow, a, aLow));
+    default /* nd, np */: return Variable(r);
+    }
+}
+
+}
+
+// infer which instructions of a program can be typed, starting from the
+// current state (which it is then only used for)
+void Snowman::infer(Program& prog) {
+    Inference inf;
+    inf.known = true;
+    inf.savedKnown = false;
+    inf.topLevel = false;
+    inf.errors = nullptr;
+    inf.permavar = prog.typedPermavar = permavars[activePermavar].type;
+    for (int i = 0; i < 8; ++i) {
+        inf.active[i] = prog.typedActive[i] = activeVars[i];
+        // (only the active variables are checked before each run)
+        inf.types[i] = prog.typedTypes[i] = activeVars[i] ? vars[i].type : ANY;
+    }
+    inf.run(prog.instructions);
+    for (const Instruction& ins : prog.instructions) {
+        if (ins.typed) prog.typed = true;
+    }
+}
+
+// whether the program starts out in the state infer typed it for
+bool Snowman::typedEntry(const Program& prog) {
+    if (permavars[activePermavar].type != prog.typedPermavar) return false;
+    for (int i = 0; i < 8; ++i) {
+        if (activeVars[i] != prog.typedActive[i]) return false;
+        if (activeVars[i] && vars[i].type != prog.typedTypes[i]) return false;
+    }
+    return true;
+}
+
+// execute a typed instruction: its arguments are numbers in known variables,
+// and its result goes in a known one (or nowhere), so it can't fail
+void Snowman::stepTyped(const Instruction& ins) {
+    if (ins.type == Instruction::NUMBER) {
+        if (ins.dest >= 0) vars[ins.dest] = Variable(ins.num, ins.numLow);
+        return;
+    }
+    const Variable& x = vars[(int)ins.args[0]];
+    tNum a = x.numVal, b = 0;
+    int aLow = x.numLow, bLow = 0;
+    if (ins.args[1] >= 0) {
+        b = vars[(int)ins.args[1]].numVal;
+        bLow = vars[(int)ins.args[1]].numLow;
+    }
+    if (ins.consume) {
+        vars[(int)ins.args[0]] = Variable();
+        if (ins.args[1] >= 0) vars[(int)ins.args[1]] = Variable();
+    }
+    if (ins.dest < 0) return;
+    tNum r = typedResult(ins.op, a, b);
+    if (!(aLow | bLow) && fabs(r) < EXACT_LIMIT) {
+        vars[(int)ins.dest] = Variable(r);
+    } else {
+        vars[(int)ins.dest] = typedExact(ins.op, a, aLow, b, bLow, r);
+    }
+}
+
+// errors that are certain to happen when some code is run (from the start,
+// with nothing active); throws if it can't be tokenized
+std::vector<std::string> Snowman::check(std::string code) {
+    std::vector<Instruction> ins;
+    for (std::string token : tokenize(code)) ins.push_back(decode(token));
+    std::vector<std::string> errors;
+    Inference inf;
+    inf.known = true;
+    inf.savedKnown = true;
+    inf.topLevel = true;
+    inf.errors = &errors;
+    inf.permavar = Variable::UNDEFINED;
+    for (int i = 0; i < 8; ++i) {
+        inf.active[i] = inf.saved[i] = false;
+        inf.types[i] = Variable::UNDEFINED;
+    }
+    inf.run(ins);
+    return errors;
+}
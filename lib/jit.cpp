@@ -0,0 +1,392 @@
+#include "snowman.hpp"
+#include <cstdint>    // uint64_t, int32_t
+// included from snowman.hpp: <vector>, <string>, <cstring>
+
+// a small template JIT for hot blocks. every instruction is turned into a
+// fixed snippet of x86-64 code: variable rotations, active variable toggles,
+// number literals and the simplest number operators are done inline, and
+// everything else is a call back into evalToken (through jitCall).
+//
+// which variables an operator reads and writes depends on which ones are
+// active, so the code is specialized for the active variables the block had
+// when it was compiled, and tracks them through the block for as long as they
+// can be known statically (running another block or `&' makes them unknown,
+// after which only callbacks are emitted). a run that starts with different
+// active variables is interpreted instead.
+//
+// the native function is called as fn(this, &vars, &activeVars) and returns
+// 0 when it ran to the end, 1 if it had to stop because of a fatal error, and
+// 2 if it refused to run (active variables didn't match).
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h> // mmap, mprotect, munmap
+
+#define HSH2(a,b) (((long)a)*256 + ((long)b))
+#define HSH3(a,b,c) (((long)a)*256*256 + ((long)b)*256 + ((long)c))
+
+namespace {
+
+typedef int (*NativeFn)(Snowman*, Variable**, bool**);
+
+// byte offsets of a variable slot (its type, then its numLow) and its value
+inline int slot(int i) { return i * sizeof(Variable); }
+inline int slotVal(int i) { return i * sizeof(Variable) + 8; }
+
+const int T_UNDEFINED = Variable::UNDEFINED, T_NUM = Variable::NUM;
+
+class Emitter {
+    public:
+    std::vector<unsigned char> buf;
+
+    void b(std::initializer_list<int> bytes) {
+        for (int x : bytes) buf.push_back((unsigned char)x);
+    }
+    void imm32(uint32_t x) {
+        for (int i = 0; i < 4; ++i) buf.push_back((x >> (8*i)) & 0xff);
+    }
+    void imm64(uint64_t x) {
+        for (int i = 0; i < 8; ++i) buf.push_back((x >> (8*i)) & 0xff);
+    }
+
+    // rel32 jumps get patched once their target is known
+    vvs jcc(int cc) { b({0x0f, cc}); imm32(0); return buf.size() - 4; }
+    vvs jmp() { b({0xe9}); imm32(0); return buf.size() - 4; }
+    void patch(vvs at) { patch(at, buf.size()); }
+    void patch(vvs at, vvs target) {
+        int32_t rel = target - (at + 4);
+        std::memcpy(&buf[at], &rel, 4);
+    }
+
+    // mov rax, [r12] / mov rax, [r13]
+    void loadVars() { b({0x49, 0x8b, 0x04, 0x24}); }
+    void loadActive() { b({0x49, 0x8b, 0x45, 0x00}); }
+
+    // (vars in rax) swap slots with movups through xmm0..xmm2
+    void rot2(int x, int y) {
+        loadVars();
+        b({0x0f, 0x10, 0x40, slot(x)});
+        b({0x0f, 0x10, 0x48, slot(y)});
+        b({0x0f, 0x11, 0x48, slot(x)});
+        b({0x0f, 0x11, 0x40, slot(y)});
+    }
+    void rot3(int x, int y, int z) {
+        loadVars();
+        b({0x0f, 0x10, 0x40, slot(x)});
+        b({0x0f, 0x10, 0x48, slot(y)});
+        b({0x0f, 0x10, 0x50, slot(z)});
+        b({0x0f, 0x11, 0x48, slot(x)});
+        b({0x0f, 0x11, 0x50, slot(y)});
+        b({0x0f, 0x11, 0x40, slot(z)});
+    }
+
+    // (activeVars in rax) xor byte [rax+i], 1
+    void toggle(int i) { b({0x80, 0x70, i, 0x01}); }
+
+    // (vars in rax) jne to slow path unless slot i holds a number with no
+    // numLow (compared one dword at a time, since the interpreter stores
+    // them separately, and a qword load of both would stall)
+    void requireNum(int i, std::vector<vvs>& slow) {
+        b({0x83, 0x78, slot(i), T_NUM});
+        slow.push_back(jcc(0x85));
+        b({0x83, 0x78, slot(i) + 4, 0});
+        slow.push_back(jcc(0x85));
+    }
+
+    // jae to slow path unless xmm0 is below 2^53 (and so exact, see arith)
+    void requireExact(std::vector<vvs>& slow) {
+        b({0x66, 0x48, 0x0f, 0x7e, 0xc1});     // movq rcx, xmm0
+        b({0x48, 0xd1, 0xe1});                 // shl rcx, 1 (drops the sign)
+        b({0x48, 0xba}); imm64(0x8680000000000000ULL); // mov rdx, 2^53 << 1
+        b({0x48, 0x39, 0xd1});                 // cmp rcx, rdx
+        slow.push_back(jcc(0x83));
+    }
+
+    // (vars in rax) store xmm0 as a number in the first undefined slot of
+    // the given ones, like Snowman::store
+    void storeXmm0(const std::vector<int>& slots) {
+        std::vector<vvs> done;
+        for (int i : slots) {
+            b({0x83, 0x78, slot(i), T_UNDEFINED});   // cmp dword [i], 0
+            b({0x75, 8 + 5 + 5});                    // jne next
+            b({0x48, 0xc7, 0x40, slot(i)});          // mov qword [i], NUM
+            imm32(T_NUM);                            //   (numLow 0)
+            b({0xf2, 0x0f, 0x11, 0x40, slotVal(i)}); // movsd [i+8], xmm0
+            done.push_back(jmp());
+        }
+        for (vvs at : done) patch(at);
+    }
+
+    // call fn(sm, ins) (that is, Snowman::jitCall), and leave with its
+    // return value if nonzero
+    uint64_t fn;
+    void callback(const Instruction* ins, std::vector<vvs>& exits) {
+        b({0x48, 0x89, 0xdf});                  // mov rdi, rbx
+        b({0x48, 0xbe}); imm64((uint64_t)ins);  // mov rsi, ins
+        b({0x48, 0xb8}); imm64(fn);             // mov rax, fn
+        b({0xff, 0xd0});                        // call rax
+        b({0x85, 0xc0});                        // test eax, eax
+        exits.push_back(jcc(0x85));             // jnz exit
+    }
+};
+
+// rotation operators, as in the ROT2/ROT3 macros in snowman.cpp
+int rotation(long op, int rot[3]) {
+    switch (op) {
+    case '/': rot[0] = 2; rot[1] = 5; return 2;
+    case '\\': rot[0] = 0; rot[1] = 7; return 2;
+    case '_': rot[0] = 5; rot[1] = 7; return 2;
+    case '[': rot[0] = 0; rot[1] = 5; return 2;
+    case ']': rot[0] = 2; rot[1] = 7; return 2;
+    case '|': rot[0] = 1; rot[1] = 6; return 2;
+    case '-': rot[0] = 3; rot[1] = 4; return 2;
+    case '\'': rot[0] = 1; rot[1] = 3; return 2;
+    case '`': rot[0] = 1; rot[1] = 4; return 2;
+    case ',': rot[0] = 4; rot[1] = 6; return 2;
+    case '.': rot[0] = 3; rot[1] = 6; return 2;
+    case '^': rot[0] = 1; rot[1] = 3; rot[2] = 4; return 3;
+    case '>': rot[0] = 5; rot[1] = 4; rot[2] = 0; return 3;
+    case '<': rot[0] = 2; rot[1] = 3; rot[2] = 7; return 3;
+    default: return 0;
+    }
+}
+
+// operators that run blocks, and can therefore do anything to the active
+// variables
+bool runsBlocks(long op) {
+    switch (op) {
+    case HSH3('A','S','B'): case HSH2('a','f'): case HSH2('a','e'):
+    case HSH2('a','m'): case HSH3('A','S','E'): case HSH3('A','S','I'):
+    case HSH3('S','R','B'): case HSH2('b','r'): case HSH2('b','w'):
+    case HSH2('b','i'): case HSH2('b','d'): case HSH2('b','e'):
+        return true;
+    default:
+        return false;
+    }
+}
+
+}
+
+bool Snowman::jitCompile(Program& prog) {
+    Emitter e;
+    e.fn = (uint64_t)&Snowman::jitCall;
+    std::vector<vvs> exits;
+
+    bool active[8];
+    std::memcpy(active, activeVars, sizeof(bool)*8);
+    bool known = true;
+    uint64_t mask;
+    std::memcpy(&mask, active, sizeof(mask));
+
+    // push rbx; push r12; push r13 (also aligns the stack for calls)
+    e.b({0x53, 0x41, 0x54, 0x41, 0x55});
+    e.b({0x48, 0x89, 0xfb});  // mov rbx, rdi
+    e.b({0x49, 0x89, 0xf4});  // mov r12, rsi
+    e.b({0x49, 0x89, 0xd5});  // mov r13, rdx
+
+    // refuse to run with different active variables
+    e.loadActive();
+    e.b({0x48, 0x8b, 0x00});          // mov rax, [rax]
+    e.b({0x48, 0xb9}); e.imm64(mask); // mov rcx, mask
+    e.b({0x48, 0x39, 0xc8});          // cmp rax, rcx
+    vvs guard = e.jcc(0x85);
+
+    for (const Instruction& ins : prog.instructions) {
+        // active slots in order, which is what store/retrieve go through
+        std::vector<int> slots;
+        for (int i = 0; i < 8; ++i) if (active[i]) slots.push_back(i);
+
+        int rot[3];
+        if (ins.type == Instruction::OPERATOR && rotation(ins.op, rot)) {
+            if (rotation(ins.op, rot) == 2) e.rot2(rot[0], rot[1]);
+            else e.rot3(rot[0], rot[1], rot[2]);
+            continue;
+        }
+
+        if (ins.type == Instruction::OPERATOR && known) {
+            switch (ins.op) {
+            case '(': case ')': case '{': case '}': {
+                const char* toggled = ins.op == '(' ? "\0\5" :
+                    ins.op == ')' ? "\2\7" : ins.op == '{' ? "\1\3\6" : "\1\4\6";
+                int n = (ins.op == '(' || ins.op == ')') ? 2 : 3;
+                e.loadActive();
+                for (int i = 0; i < n; ++i) {
+                    e.toggle(toggled[i]);
+                    active[(int)toggled[i]] = !active[(int)toggled[i]];
+                }
+                continue;
+            }
+            case '~':
+                e.loadActive();
+                e.b({0x48, 0xb9}); e.imm64(0x0101010101010101ULL);
+                e.b({0x48, 0x31, 0x08});  // xor [rax], rcx
+                for (int i = 0; i < 8; ++i) active[i] = !active[i];
+                continue;
+            case '?':
+                e.loadActive();
+                e.b({0x48, 0xc7, 0x00}); e.imm32(0);  // mov qword [rax], 0
+                for (int i = 0; i < 8; ++i) active[i] = false;
+                continue;
+            case '@': case '%': {
+                // done by the interpreter, but still known afterwards
+                e.callback(&ins, exits);
+                for (int n = (ins.op == '@' ? 1 : 4); n; --n) {
+                    bool b = active[0]; active[0] = active[3];
+                    active[3] = active[5]; active[5] = active[6];
+                    active[6] = active[7]; active[7] = active[4];
+                    active[4] = active[2]; active[2] = active[1];
+                    active[1] = b;
+                }
+                continue;
+            }
+            case HSH2('n','a'): case HSH2('n','s'):
+            case HSH2('n','m'): case HSH2('n','d'): {
+                if (slots.size() < 2) break;
+                int x = slots[0], y = slots[1];
+                int opcode = ins.op == HSH2('n','a') ? 0x58 :
+                    ins.op == HSH2('n','s') ? 0x5c :
+                    ins.op == HSH2('n','m') ? 0x59 : 0x5e;
+                e.loadVars();
+                std::vector<vvs> slow;
+                e.requireNum(x, slow);
+                e.requireNum(y, slow);
+                e.b({0xf2, 0x0f, 0x10, 0x40, slotVal(x)});   // movsd xmm0, [x]
+                e.b({0xf2, 0x0f, opcode, 0x40, slotVal(y)}); // op xmm0, [y]
+                if (ins.op != HSH2('n','d')) e.requireExact(slow);
+                if (ins.consume) {
+                    // both consumed, and the result goes where x was
+                    e.b({0xc7, 0x40, slot(y)}); e.imm32(T_UNDEFINED);
+                    e.b({0xf2, 0x0f, 0x11, 0x40, slotVal(x)});
+                } else {
+                    e.storeXmm0(std::vector<int>(slots.begin() + 2,
+                        slots.end()));
+                }
+                vvs done = e.jmp();
+                for (vvs at : slow) e.patch(at);
+                e.callback(&ins, exits);
+                e.patch(done);
+                continue;
+            }
+            case HSH3('N','I','N'): case HSH3('N','D','E'): {
+                if (slots.size() < 1) break;
+                int x = slots[0];
+                e.loadVars();
+                std::vector<vvs> slow;
+                e.requireNum(x, slow);
+                e.b({0xf2, 0x0f, 0x10, 0x40, slotVal(x)});  // movsd xmm0, [x]
+                tNum one = 1;
+                uint64_t bits;
+                std::memcpy(&bits, &one, sizeof(bits));
+                e.b({0x48, 0xb9}); e.imm64(bits);           // mov rcx, 1.0
+                e.b({0x66, 0x48, 0x0f, 0x6e, 0xc9});        // movq xmm1, rcx
+                e.b({0xf2, 0x0f, ins.op == HSH3('N','I','N') ? 0x58 : 0x5c,
+                    0xc1});                                 // add/subsd
+                e.requireExact(slow);
+                if (ins.consume) {
+                    e.b({0xf2, 0x0f, 0x11, 0x40, slotVal(x)});
+                } else {
+                    e.storeXmm0(std::vector<int>(slots.begin() + 1,
+                        slots.end()));
+                }
+                vvs done = e.jmp();
+                for (vvs at : slow) e.patch(at);
+                e.callback(&ins, exits);
+                e.patch(done);
+                continue;
+            }
+            default:
+                break;
+            }
+        }
+
+        if (ins.type == Instruction::NUMBER && ins.error.empty() &&
+                !ins.numLow && known) {
+            uint64_t bits;
+            std::memcpy(&bits, &ins.num, sizeof(bits));
+            e.loadVars();
+            e.b({0x48, 0xb9}); e.imm64(bits);  // mov rcx, num
+            std::vector<vvs> done;
+            for (int i : slots) {
+                e.b({0x83, 0x78, slot(i), T_UNDEFINED});  // cmp dword [i], 0
+                e.b({0x75, 8 + 4 + 5});                   // jne next
+                e.b({0x48, 0xc7, 0x40, slot(i)}); e.imm32(T_NUM);
+                e.b({0x48, 0x89, 0x48, slotVal(i)});      // mov [i+8], rcx
+                done.push_back(e.jmp());
+            }
+            for (vvs at : done) e.patch(at);
+            continue;
+        }
+
+        // anything else is left to the interpreter
+        e.callback(&ins, exits);
+        if (ins.type == Instruction::SUB_START) {
+            // new frames always start out with nothing active
+            for (int i = 0; i < 8; ++i) active[i] = false;
+        } else if (ins.type == Instruction::SUB_END ||
+                (ins.type == Instruction::OPERATOR &&
+                 (ins.op == '&' || runsBlocks(ins.op)))) {
+            known = false;
+        }
+    }
+
+    e.b({0x31, 0xc0});  // xor eax, eax
+    for (vvs at : exits) e.patch(at);
+    e.b({0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3});  // pop r13; pop r12; pop rbx; ret
+    e.patch(guard);
+    e.b({0xb8}); e.imm32(2);  // mov eax, 2
+    e.b({0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3});
+
+    void* mem = mmap(nullptr, e.buf.size(), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        prog.nativeFailed = true;
+        return false;
+    }
+    std::memcpy(mem, e.buf.data(), e.buf.size());
+    if (mprotect(mem, e.buf.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, e.buf.size());
+        prog.nativeFailed = true;
+        return false;
+    }
+    prog.native = mem;
+    prog.nativeSize = e.buf.size();
+    return true;
+}
+
+bool Snowman::runNative(Program& prog) {
+    NativeFn fn = reinterpret_cast<NativeFn>(prog.native);
+    return fn(this, &vars, &activeVars) != 2;
+}
+
+Program::~Program() {
+    if (native) munmap(native, nativeSize);
+    for (auto& c : constants) c.second.mm();
+}
+
+#else
+
+// no JIT on this platform; everything is interpreted
+bool Snowman::jitCompile(Program& prog) {
+    prog.nativeFailed = true;
+    return false;
+}
+
+bool Snowman::runNative(Program&) {
+    return false;
+}
+
+Program::~Program() {
+    for (auto& c : constants) c.second.mm();
+}
+
+#endif
+
+int Snowman::jitCall(Snowman* sm, const Instruction* ins) {
+    // (an exception can't go through the native code that called this, so
+    //   a limit stops it like a fatal error, and run throws it again)
+    try {
+        return sm->step(*ins) ? 0 : 1;
+    } catch (SnowmanLimitException& se) {
+        return 1;
+    }
+}
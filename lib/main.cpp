@@ -1,8 +1,106 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
+#include <thread>
 #include "snowman.hpp"
 
+// read a file of code into code, as it's run
+static bool readFile(const std::string& filename, std::string& code) {
+    std::ifstream infile(filename.c_str());
+    if (!infile.good()) {
+        std::cerr << "Could not read file " << filename << std::endl;
+        return false;
+    }
+    std::stringstream buf;
+    buf << infile.rdbuf() << std::endl;
+    code = buf.str();
+    return true;
+}
+
+// write what the sampling profiler found: hot spots to stderr, and folded
+// stacks to a file
+static int writeProfile(Snowman& sm, const std::string& filename) {
+    std::cerr << sm.profileHotSpots();
+    std::ofstream out(filename.c_str());
+    out << sm.profileStacks();
+    if (!out.good()) {
+        std::cerr << "Could not write file " << filename << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// run the jobs of a manifest (see -g in the help) on a pool of threads, then
+// print how long each took (and what went wrong, to stderr) and how long they
+// took altogether. script is the code from the command line, if there was any
+static int runBatch(const Snowman& sm, const std::string& manifest,
+        const std::string* script, unsigned threads) {
+    std::ifstream file(manifest.c_str());
+    if (!file.good()) {
+        std::cerr << "Could not read file " << manifest << std::endl;
+        return 1;
+    }
+
+    // (every script is only compiled once, however many jobs run it)
+    std::map<std::string, Script*> scripts;
+    if (script) scripts[""] = new Script(*script);
+    std::vector<BatchJob> jobs;
+    std::string line;
+    for (int n = 1; std::getline(file, line); ++n) {
+        std::istringstream fields(line);
+        std::string scriptFile, input, output, extra;
+        if (!script) fields >> scriptFile;
+        fields >> input >> output >> extra;
+        if ((script ? input : scriptFile).empty() ||
+                (script ? input : scriptFile)[0] == '#') {
+            continue;
+        }
+        if (input.empty() || !extra.empty()) {
+            std::cerr << manifest << ":" << n << ": expected " <<
+                (script ? "" : "a script, ") << "an input file and "
+                "optionally an output file" << std::endl;
+            for (auto& s : scripts) delete s.second;
+            return 1;
+        }
+        if (!scripts.count(scriptFile)) {
+            std::string code;
+            if (!readFile(scriptFile, code)) {
+                for (auto& s : scripts) delete s.second;
+                return 1;
+            }
+            scripts[scriptFile] = new Script(code);
+        }
+        jobs.push_back(BatchJob{scripts[scriptFile], input,
+            output.empty() ? input + ".out" : output, 0, ""});
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    Snowman::batch(jobs, threads, sm);
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - started).count();
+
+    int status = 0;
+    double jobSeconds = 0;
+    std::cout << std::fixed << std::setprecision(3);
+    for (const BatchJob& job : jobs) {
+        std::cout << job.input << " -> " << job.output << ": " <<
+            job.milliseconds << " ms" << (job.errors.empty() ? "" :
+            " (with errors)") << std::endl;
+        if (!job.errors.empty()) {
+            std::cerr << job.input << ":\n" << job.errors;
+            status = 1;
+        }
+        jobSeconds += job.milliseconds / 1000;
+    }
+    std::cout << jobs.size() << " jobs on " << threads << " threads in " <<
+        seconds << " s (" << (seconds > 0 ? jobs.size() / seconds : 0) <<
+        " jobs/s; " << jobSeconds << " s spent in jobs)" << std::endl;
+
+    for (auto& s : scripts) delete s.second;
+    return status;
+}
+
 int main(int argc, char *argv[]) {
     Snowman sm = Snowman();
 
@@ -11,7 +109,8 @@ int main(int argc, char *argv[]) {
         std::to_string(Snowman::PATCH_VERSION);
 
     // parse arguments
-    std::string filename, code;
+    std::string filename, code, profileFilename, batchFilename;
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
     bool parseFlags = true;
     bool flags[128] = {false};
     for (int i = 1; i < argc; ++i) {
@@ -23,10 +122,27 @@ int main(int argc, char *argv[]) {
                 // no switch on strings :(
                 if (arg == "") parseFlags = false;
                 else if (arg == "debug")       arg = "d";
+                else if (arg == "debug-depth") arg = "n";
+                else if (arg == "debug-elide") arg = "u";
+                else if (arg == "debug-items") arg = "t";
+                else if (arg == "emit-cpp")    arg = "c";
                 else if (arg == "evaluate")    arg = "e";
                 else if (arg == "help")        arg = "h";
+                else if (arg == "instruction-limit") arg = "b";
                 else if (arg == "interactive") arg = "i";
+                else if (arg == "jit")         arg = "j";
+                else if (arg == "check")       arg = "k";
+                else if (arg == "limit-dump")  arg = "l";
                 else if (arg == "minify")      arg = "m";
+                else if (arg == "count-pairs") arg = "p";
+                else if (arg == "batch")       arg = "g";
+                else if (arg == "max-depth")   arg = "s";
+                else if (arg == "mem-stats")   arg = "a";
+                else if (arg == "memory-limit") arg = "x";
+                else if (arg == "sample-profile") arg = "f";
+                else if (arg == "seed")        arg = "r";
+                else if (arg == "threads")     arg = "y";
+                else if (arg == "time-limit")  arg = "w";
                 else {
                     std::cerr << "Unknown long argument `" << arg << "'" <<
                         std::endl;
@@ -48,9 +164,135 @@ int main(int argc, char *argv[]) {
                     }
                     code = argv[i];
                     break;
+                case 'f':
+                    if ((++i) == argc) {
+                        std::cerr << "Argument `-f' requires a parameter" <<
+                            std::endl;
+                        return 1;
+                    }
+                    sm.sampleProfile = true;
+                    profileFilename = argv[i];
+                    break;
+                case 'g':
+                    if ((++i) == argc) {
+                        std::cerr << "Argument `-g' requires a parameter" <<
+                            std::endl;
+                        return 1;
+                    }
+                    batchFilename = argv[i];
+                    break;
+                case 'y':
+                    if ((++i) == argc) {
+                        std::cerr << "Argument `-y' requires a parameter" <<
+                            std::endl;
+                        return 1;
+                    }
+                    try {
+                        threads = std::stoul(argv[i]);
+                    } catch (const std::logic_error& e) {
+                        threads = 0;
+                    }
+                    if (threads == 0) {
+                        std::cerr << "Invalid number of threads `" << argv[i] <<
+                            "'" << std::endl;
+                        return 1;
+                    }
+                    break;
+                case 'j':
+                    if ((++i) == argc) {
+                        std::cerr << "Argument `-j' requires a parameter" <<
+                            std::endl;
+                        return 1;
+                    }
+                    try {
+                        sm.jitThreshold = std::stoul(argv[i]);
+                    } catch (const std::logic_error& e) {
+                        std::cerr << "Invalid JIT threshold `" << argv[i] <<
+                            "'" << std::endl;
+                        return 1;
+                    }
+                    break;
+                case 'n':
+                case 't':
+                    if ((++i) == argc) {
+                        std::cerr << "Argument `-" << argid << "' requires a "
+                            "parameter" << std::endl;
+                        return 1;
+                    }
+                    try {
+                        (argid == 'n' ? sm.debugDepth : sm.debugItems) =
+                            std::stoul(argv[i]);
+                    } catch (const std::logic_error& e) {
+                        std::cerr << "Invalid " << (argid == 'n' ? "depth" :
+                            "number of elements") << " `" << argv[i] << "'" <<
+                            std::endl;
+                        return 1;
+                    }
+                    break;
+                case 'u':
+                    sm.debugElide = true;
+                    break;
+                case 'a':
+                    sm.memStats = true;
+                    break;
+                case 'b':
+                case 'w':
+                case 'x':
+                    if ((++i) == argc) {
+                        std::cerr << "Argument `-" << argid << "' requires a "
+                            "parameter" << std::endl;
+                        return 1;
+                    }
+                    try {
+                        if (argid == 'b') {
+                            sm.instructionLimit = std::stoull(argv[i]);
+                        } else {
+                            (argid == 'w' ? sm.timeLimit : sm.memoryLimit) =
+                                std::stoul(argv[i]);
+                        }
+                    } catch (const std::logic_error& e) {
+                        std::cerr << "Invalid limit `" << argv[i] << "'" <<
+                            std::endl;
+                        return 1;
+                    }
+                    break;
+                case 'l':
+                    sm.limitDump = true;
+                    break;
+                case 'r':
+                    if ((++i) == argc) {
+                        std::cerr << "Argument `-r' requires a parameter" <<
+                            std::endl;
+                        return 1;
+                    }
+                    try {
+                        sm.seed(std::stoull(argv[i]));
+                    } catch (const std::logic_error& e) {
+                        std::cerr << "Invalid seed `" << argv[i] << "'" <<
+                            std::endl;
+                        return 1;
+                    }
+                    break;
+                case 's':
+                    if ((++i) == argc) {
+                        std::cerr << "Argument `-s' requires a parameter" <<
+                            std::endl;
+                        return 1;
+                    }
+                    try {
+                        sm.setMaxDepth(std::stoul(argv[i]));
+                    } catch (const std::logic_error& e) {
+                        std::cerr << "Invalid maximum depth `" << argv[i] <<
+                            "'" << std::endl;
+                        return 1;
+                    }
+                    break;
+                case 'c':
                 case 'h':
                 case 'i':
+                case 'k':
                 case 'm':
+                case 'p':
                     flags[(int)argid] = true;
                     break;
                 default:
@@ -67,23 +309,17 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // retrieve code to run
-    if (!(flags['e'] || flags['h'] || flags['i'])) {
+    // retrieve code to run (for -g, only if there's one script for all of
+    //   the jobs)
+    if (!(flags['e'] || flags['h'] || flags['i'] ||
+            (batchFilename != "" && filename == ""))) {
         if ((filename == "") || (filename == "-")) {
             std::string line;
             while (std::getline(std::cin, line) && line != "__END__") {
                 code += line + "\n";
             }
-        } else {
-            std::ifstream infile(filename.c_str());
-            if (infile.good()) {
-                std::stringstream buf;
-                buf << infile.rdbuf() << std::endl;
-                code = buf.str();
-            } else {
-                std::cerr << "Could not read file " << filename << std::endl;
-                return 1;
-            }
+        } else if (!readFile(filename, code)) {
+            return 1;
         }
     }
 
@@ -92,18 +328,87 @@ int main(int argc, char *argv[]) {
         std::cout << "Usage: " << argv[0] << " [OPTION]... "
                 "[FILENAME]\n" <<
             "Options:\n"
+            "    -a, --mem-stats: print to stderr at the end how many arrays, "
+                "blocks and dictionaries there were, the bytes allocated (in "
+                "builds that count them), what each operator allocated, and "
+                "what was left that can't be reached anymore\n"
+            "    -b, --instruction-limit: takes one parameter, stop a run after "
+                "about that many instructions (default no limit)\n"
+            "    -c, --emit-cpp: don't evaluate code; output an equivalent C++ "
+                "program instead\n"
             "    -d, --debug: include debug output\n"
             "    -e, --evaluate: takes one parameter, runs as Snowman code\n"
+            "    -f, --sample-profile: takes one parameter, sample where runs "
+                "spend their time; print the lines and columns that take the "
+                "most to stderr, and write folded stacks (for flame graphs) to "
+                "the file given (Linux only)\n"
+            "    -g, --batch: takes one parameter, a manifest of jobs to run at "
+                "once on a pool of threads, one job per line: an input file "
+                "(read by the script instead of stdin) and optionally an output "
+                "file (its stdout, by default the input's name with .out "
+                "appended); before those, the script to run, unless a "
+                "FILENAME or -e gives one for every job. blank lines and lines "
+                "starting with # are skipped\n"
             "    -h, --help: display this message\n"
             "    -i, --interactive: start a REPL\n"
+            "    -j, --jit: takes one parameter, compile blocks to native code "
+                "once they have run that many times (x86-64 Linux only; off by "
+                "default)\n"
+            "    -k, --check: don't evaluate code; output the errors that are "
+                "certain to happen when it runs (as far as they can be known "
+                "without running it)\n"
+            "    -l, --limit-dump: when a limit stops a run, print the variables "
+                "to stderr\n"
             "    -m, --minify: don't evaluate code; output minified version "
                 "instead\n"
+            "    -n, --debug-depth: takes one parameter, how many levels of "
+                "nested arrays and dictionaries debug output shows (default "
+                "all)\n"
+            "    -p, --count-pairs: don't evaluate code; output how often each "
+                "pair of instructions that could be a superinstruction appears "
+                "(see tools/superinstructions.sh)\n"
+            "    -r, --seed: takes one parameter, seed for the random numbers "
+                "of vr, nra and ash, so that a run can be repeated (default: "
+                "the time)\n"
+            "    -s, --max-depth: takes one parameter, maximum nesting of "
+                "subroutines (default " << Snowman::DEFAULT_MAX_DEPTH << ")\n"
+            "    -t, --debug-items: takes one parameter, how many elements "
+                "debug output shows at the start and at the end of an array or "
+                "dictionary (default all)\n"
+            "    -u, --debug-elide: show variables that haven't changed since "
+                "the previous debug output as (same)\n"
+            "    -w, --time-limit: takes one parameter, stop a run after that "
+                "many milliseconds (default no limit)\n"
+            "    -x, --memory-limit: takes one parameter, stop a run once it "
+                "has that many megabytes allocated that it hasn't freed (only "
+                "in builds that count them; default no limit)\n"
+            "    -y, --threads: takes one parameter, how many threads -g runs "
+                "jobs on (default one for each core)\n"
             "Snowman will read from STDIN if you do not specify a file name "
-                "or the -ehi options.\n"
+                "or the -eghi options.\n"
             "Snowman version: " << VERSION_STRING << "\n";
         return 0;
     }
 
+    // (without bytes to count, the limit would never be reached)
+    if (sm.memoryLimit && !Heap::countsBytes) {
+        std::cerr << "Argument `-x' needs a build that counts bytes (with "
+            "SNOWMAN_HEAP_BYTES)" << std::endl;
+        return 1;
+    }
+
+    // process -g (--batch) flag
+    if (batchFilename != "") {
+        if (sm.memStats || sm.sampleProfile || flags['c'] || flags['i'] ||
+                flags['k'] || flags['m'] || flags['p']) {
+            std::cerr << "Argument `-g' can't be used with -a, -c, -f, -i, "
+                "-k, -m or -p" << std::endl;
+            return 1;
+        }
+        return runBatch(sm, batchFilename,
+            flags['e'] || filename != "" ? &code : nullptr, threads);
+    }
+
     // process -i (--interactive) flag
     if (flags['i']) {
         std::cout << "Snowman REPL, " << VERSION_STRING <<
@@ -123,6 +428,8 @@ int main(int argc, char *argv[]) {
                 std::cout << ">> ";
             }
         }
+        if (sm.memStats) std::cerr << sm.memoryReport();
+        if (sm.sampleProfile) return writeProfile(sm, profileFilename);
         return 0;
     }
 
@@ -135,6 +442,49 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    // process -c (--emit-cpp) flag
+    if (flags['c']) {
+        try {
+            std::cout << Snowman::emitCpp(code);
+        } catch (SnowmanException& se) {
+            std::cerr << "SnowmanException thrown at tokenize" << std::endl;
+            std::cerr << "  what():  " << se.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // process -k (--check) flag
+    if (flags['k']) {
+        try {
+            for (const std::string& error : Snowman::check(code)) {
+                std::cout << error << std::endl;
+            }
+        } catch (SnowmanException& se) {
+            std::cerr << "SnowmanException thrown at tokenize" << std::endl;
+            std::cerr << "  what():  " << se.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // process -p (--count-pairs) flag
+    if (flags['p']) {
+        try {
+            for (auto& p : Snowman::countPairs(code)) {
+                std::cout << p.first.first << " " << p.first.second << " " <<
+                    p.second << std::endl;
+            }
+        } catch (SnowmanException& se) {
+            std::cerr << "SnowmanException thrown at tokenize" << std::endl;
+            std::cerr << "  what():  " << se.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
     // run code
     sm.run(code);
+    if (sm.memStats) std::cerr << sm.memoryReport();
+    if (sm.sampleProfile) return writeProfile(sm, profileFilename);
 }
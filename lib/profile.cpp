@@ -0,0 +1,172 @@
+#include "snowman.hpp"
+#include <algorithm>  // std::upper_bound, std::sort
+#ifdef __linux__
+#include <sys/time.h> // setitimer
+#endif
+// included from snowman.hpp: <vector>, <string>, <map>, <csignal>
+
+// the sampling profiler: a timer (of the CPU time the process uses) raises
+// SIGPROF every SAMPLE_INTERVAL microseconds, and the handler only counts it.
+// execute notices the count after the instruction that was running finishes
+// and records a sample (as many as came in, so a long instruction weighs as
+// much as the time it took) of the instruction every frame on profileStack is
+// at. that way nothing has to be done in the handler, and the instruction
+// loop only looks at one variable while the profiler is off
+//
+// instructions know where they came from through their program's locations,
+// which compile fills in from a SourceMap: the lines of the code given to
+// run, or the source of a block literal (made when the code around it was
+// compiled, since the block's own code is minified)
+
+volatile sig_atomic_t Snowman::samplesDue = 0;
+
+Location locate(const SourceMap& map, std::string::size_type offset) {
+    auto it = std::upper_bound(map.begin(), map.end(), offset,
+        [](std::string::size_type o,
+                const std::pair<std::string::size_type, Location>& e) {
+            return o < e.first;
+        });
+    if (it == map.begin() || (--it)->second.line == 0) return Location{0, 0};
+    return Location{it->second.line,
+        it->second.column + (unsigned)(offset - it->first)};
+}
+
+SourceMap sourceLines(const std::string& code) {
+    SourceMap lines{std::make_pair(0, Location{1, 1})};
+    for (std::string::size_type i = 0; i < code.length(); ++i) {
+        if (code[i] == '\n') {
+            lines.push_back(std::make_pair(i + 1,
+                Location{lines.back().second.line + 1, 1}));
+        }
+    }
+    return lines;
+}
+
+void Snowman::onSample(int) {
+    ++samplesDue;
+}
+
+#ifdef __linux__
+
+void Snowman::startSampling() {
+    profileStack.clear();
+    samplesDue = 0;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = onSample;
+    // (so that reading input isn't cut short by a sample)
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, nullptr);
+    itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = SAMPLE_INTERVAL;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+void Snowman::stopSampling() {
+    itimerval timer;
+    memset(&timer, 0, sizeof timer);
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    // (samples that came in outside of any instruction aren't counted)
+    samplesDue = 0;
+}
+
+#else
+
+// no timer on this platform; nothing is ever sampled
+void Snowman::startSampling() {
+    profileStack.clear();
+}
+
+void Snowman::stopSampling() {}
+
+#endif
+
+// how an instruction is shown: its token, cut short if it's a long literal,
+// and without the `;' that separates frames in folded stacks or line breaks
+static std::string shortToken(const std::string& token) {
+    std::string name = token.length() > 16 ? token.substr(0, 13) + "..." :
+        token;
+    for (char& c : name) {
+        if (c == ';' || c < ' ') c = '_';
+    }
+    return name;
+}
+
+static std::string where(unsigned line, unsigned column) {
+    return line ? std::to_string(line) + ":" + std::to_string(column) : "?";
+}
+
+void Snowman::sample() {
+    // (a signal between reading the count and clearing it is lost, but that
+    //   only loses a sample)
+    unsigned long n = samplesDue;
+    samplesDue = 0;
+    samples += n;
+
+    std::string stack;
+    for (vvs f = 0; f < profileStack.size(); ++f) {
+        const Program& prog = *profileStack[f].prog;
+        vvs at = *profileStack[f].at;
+        Location loc = at < prog.locations.size() ? prog.locations[at] :
+            Location{0, 0};
+        const std::string& token = prog.instructions[at].token;
+        if (f) stack += ';';
+        stack += shortToken(token) + " (" + where(loc.line, loc.column) + ")";
+
+        HotSpot& spot = hotSpots[std::make_pair(loc.line, loc.column)];
+        if (spot.token.empty()) spot.token = shortToken(token);
+        if (f + 1 == profileStack.size()) spot.self += n;
+        // (recursion would count the same place more than once otherwise)
+        bool below = false;
+        for (vvs g = 0; g < f && !below; ++g) {
+            const Program& p = *profileStack[g].prog;
+            vvs a = *profileStack[g].at;
+            below = a < p.locations.size() && p.locations[a].line == loc.line &&
+                p.locations[a].column == loc.column;
+        }
+        if (!below) spot.total += n;
+    }
+    stacks[stack] += n;
+}
+
+// a share of the samples, as a percentage with one decimal
+static std::string percent(unsigned long n, unsigned long samples) {
+    unsigned long p = samples ? (n * 1000 + samples / 2) / samples : 0;
+    std::string s = std::to_string(p / 10) + "." + std::to_string(p % 10) +
+        "%";
+    return std::string(s.length() < 7 ? 7 - s.length() : 0, ' ') + s;
+}
+
+std::string Snowman::profileHotSpots() {
+    std::string out = std::to_string(samples) + " samples (one every " +
+        std::to_string(SAMPLE_INTERVAL) + " microseconds of CPU time)\n"
+        "   self   total  line:column  instruction\n";
+    std::vector<std::pair<std::pair<unsigned, unsigned>, HotSpot>> spots(
+        hotSpots.begin(), hotSpots.end());
+    std::sort(spots.begin(), spots.end(), [](
+            const std::pair<std::pair<unsigned, unsigned>, HotSpot>& a,
+            const std::pair<std::pair<unsigned, unsigned>, HotSpot>& b) {
+        return a.second.self != b.second.self ? a.second.self > b.second.self :
+            a.second.total != b.second.total ?
+            a.second.total > b.second.total : a.first < b.first;
+    });
+    for (auto& s : spots) {
+        std::string at = where(s.first.first, s.first.second);
+        out += percent(s.second.self, samples) + " " +
+            percent(s.second.total, samples) + "  " + at +
+            std::string(at.length() < 11 ? 11 - at.length() : 0, ' ') +
+            "  " + s.second.token + "\n";
+    }
+    return out;
+}
+
+std::string Snowman::profileStacks() {
+    std::string out;
+    for (auto& s : stacks) {
+        out += s.first + " " + std::to_string(s.second) + "\n";
+    }
+    return out;
+}
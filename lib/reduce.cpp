@@ -0,0 +1,158 @@
+#include "snowman.hpp"
+#include <cmath>      // round, trunc, fabs
+// included from snowman.hpp: <vector>, <string>
+
+// native kernels for folds (aF) whose block is a single consuming number
+// operator: :nA; :nM; :NbO; :NbA; and :NbX;. on an array of numbers, such a
+// fold comes out the same as a loop in C++ that combines the elements left to
+// right, so the block doesn't have to be interpreted once per element.
+//
+// sums are also vectorized (AVX2, where the CPU has it), but only when every
+// element is an integer and the sum of their magnitudes stays below 2^53:
+// then every partial sum is exact, so adding in a different order can't
+// change the result. anything else goes through the scalar loop, in the same
+// order as the interpreter.
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define REDUCE_AVX2
+#endif
+
+namespace {
+
+enum { NONE, ADD, MUL, OR, AND, XOR };
+
+// (must match the operators in evalToken, for as long as the result stays
+// below 2^53: then the doubles are exact)
+inline tNum combine(int op, tNum a, tNum b) {
+    switch (op) {
+    case ADD: return a + b;
+    case MUL: return a * b;
+    case OR: return (tNum)(toInt(a) | toInt(b));
+    case AND: return (tNum)(toInt(a) & toInt(b));
+    default /* XOR */: return (tNum)(toInt(a) ^ toInt(b));
+    }
+}
+
+// (past that, exactly)
+Variable combine(int op, const Variable& a, tNum b) {
+    switch (op) {
+    case ADD: return arith('+', a.numVal, a.numLow, b, 0, a.numVal + b);
+    case MUL: return arith('*', a.numVal, a.numLow, b, 0, a.numVal * b);
+    case OR: return exactNum(toInt(a.numVal, a.numLow) | toInt(b));
+    case AND: return exactNum(toInt(a.numVal, a.numLow) & toInt(b));
+    default /* XOR */: return exactNum(toInt(a.numVal, a.numLow) ^ toInt(b));
+    }
+}
+
+// fold n elements, starting from the first, with at(i) giving the i-th
+template<typename F>
+Variable fold(int op, vvs n, F at) {
+    tNum r = at(0);
+    vvs i = 1;
+    for (; i < n; ++i) {
+        tNum x = combine(op, r, at(i));
+        if (!(fabs(x) < EXACT_LIMIT)) break;
+        r = x;
+    }
+    Variable v(r);
+    for (; i < n; ++i) v = combine(op, v, at(i));
+    return v;
+}
+
+int kernel(const std::string& code) {
+    // (anything longer can't be a single operator, even with whitespace)
+    if (code.length() > 16) return NONE;
+    std::vector<std::string> tokens;
+    try {
+        tokens = Snowman::tokenize(code);
+    } catch (SnowmanException& se) {
+        return NONE;
+    }
+    if (tokens.size() != 1) return NONE;
+    const std::string& t = tokens[0];
+    if (t == "nA") return ADD;
+    if (t == "nM") return MUL;
+    if (t == "NbO") return OR;
+    if (t == "NbA") return AND;
+    if (t == "NbX") return XOR;
+    return NONE;
+}
+
+#ifdef REDUCE_AVX2
+// sum of n numbers: the nums of a DENSE array (STRIDE 1), or the values of an
+// array of Variables (STRIDE 2, every second double); returns false if the
+// sum might not be exact (see above)
+template<int STRIDE>
+__attribute__((target("avx2")))
+bool exactSum(const double* p, vvs n, tNum& sum) {
+    __m256d acc = _mm256_setzero_pd(), mag = _mm256_setzero_pd(),
+        exact = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    vvs i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x;
+        if (STRIDE == 1) {
+            x = _mm256_loadu_pd(p + i);
+        } else {
+            // two Variables are 32 bytes; the values are the high halves
+            x = _mm256_unpackhi_pd(_mm256_loadu_pd(p + 2*i),
+                _mm256_loadu_pd(p + 2*i + 4));
+        }
+        acc = _mm256_add_pd(acc, x);
+        mag = _mm256_add_pd(mag, _mm256_andnot_pd(sign, x));
+        exact = _mm256_and_pd(exact, _mm256_cmp_pd(x,
+            _mm256_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC),
+            _CMP_EQ_OQ));
+    }
+    if (_mm256_movemask_pd(exact) != 0xf) return false;
+    double lanes[4], mags[4];
+    _mm256_storeu_pd(lanes, acc);
+    _mm256_storeu_pd(mags, mag);
+    double total = mags[0] + mags[1] + mags[2] + mags[3];
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; ++i) {
+        tNum x = p[STRIDE*i + STRIDE-1];
+        if (x != trunc(x)) return false;
+        total += fabs(x);
+        sum += x;
+    }
+    return total < EXACT_LIMIT;
+}
+#endif
+
+}
+
+// fold an array with a block without running the block, if possible (see
+// above); returns false if the fold has to be done the normal way
+bool Snowman::reduce(const tArray& arr, const std::string& code,
+        Variable& result) {
+    vvs n = arr.length();
+    if (n < 2) return false;
+    int op = kernel(code);
+    if (op == NONE) return false;
+
+    if (!arr.numbers()) return false;
+    // (the doubles of a DENSE array, or of a slice of one, are contiguous)
+    const tNum* p = arr.form == tArray::DENSE ? arr.nums.data() :
+        arr.form == tArray::SLICE && arr.stride == 1 &&
+        arr.source->form == tArray::DENSE ?
+        arr.source->nums.data() + arr.offset : nullptr;
+#ifdef REDUCE_AVX2
+    if (op == ADD && n >= 8 && __builtin_cpu_supports("avx2")) {
+        tNum sum;
+        if ((p && exactSum<1>(p, n, sum)) || (arr.form == tArray::EAGER &&
+                exactSum<2>((const double*)arr.data(), n, sum))) {
+            result = Variable(sum);
+            return true;
+        }
+    }
+#endif
+    if (p) {
+        result = fold(op, n, [p](vvs i) { return p[i]; });
+        return true;
+    }
+    // (lazy arrays are folded without being materialized)
+    result = fold(op, n, [&arr](vvs i) { return arr.element(i).numVal; });
+    return true;
+}
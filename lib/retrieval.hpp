@@ -3,32 +3,43 @@
 // here be dragons
 // thou art forewarned
 
+// (with the numLows, for the operators that are exact on integers past 2^53)
 template<> class Snowman::Retrieval<tNum> {
     public:
     tNum a;
+    int aLow;
     Retrieval(Snowman* sm, bool consume) {
-        a = sm->retrieve(Variable::NUM, consume).numVal;
+        Variable v = sm->retrieve(Variable::NUM, consume);
+        a = v.numVal;
+        aLow = v.numLow;
     }
 };
 
 template<> class Snowman::Retrieval<tNum, tNum> {
     public:
     tNum a, b;
+    int aLow, bLow;
     Retrieval(Snowman* sm, bool consume) {
-        a = sm->retrieve(Variable::NUM, consume).numVal;
-        b = sm->retrieve(Variable::NUM, consume, 1).numVal;
+        Variable x = sm->retrieve(Variable::NUM, consume);
+        a = x.numVal;
+        aLow = x.numLow;
+        Variable y = sm->retrieve(Variable::NUM, consume, 1);
+        b = y.numVal;
+        bLow = y.numLow;
     }
 };
 
+// (the ones that take arrays can be asked not to materialize them, for
+//   operators that handle every form of array themselves)
 template<> class Snowman::Retrieval<tArray*> {
     private: bool consume;
     public:
     tArray* a;
-    Retrieval(Snowman* sm, bool consume): consume(consume) {
-        a = sm->retrieve(Variable::ARRAY, consume).arrayVal;
+    Retrieval(Snowman* sm, bool consume, bool lazy = false): consume(consume) {
+        a = sm->retrieve(Variable::ARRAY, consume, 0, lazy).arrayVal;
     }
     ~Retrieval() {
-        if (consume) delete a;
+        if (consume) a->release();
     }
 };
 
@@ -42,7 +53,38 @@ template<> class Snowman::Retrieval<tArray*, tBlock*> {
         b = sm->retrieve(Variable::BLOCK, consume, 1).blockVal;
     }
     ~Retrieval() {
-        if (consume) { delete a; delete b; }
+        if (consume) { a->release(); b->release(); }
+    }
+};
+
+// const tArray*: for operators that only use length() and element() (ex. to
+//   go through the elements in order), so lazy arrays don't have to be
+//   materialized. these always hold a reference, so that a block that
+//   consumes the array (or itself) while the operator goes through it
+//   doesn't pull it out from under the operator
+template<> class Snowman::Retrieval<const tArray*> {
+    public:
+    tArray* a;
+    Retrieval(Snowman* sm, bool consume) {
+        a = sm->retrieve(Variable::ARRAY, consume, 0, true).arrayVal;
+        if (!consume) ++a->refs;
+    }
+    ~Retrieval() {
+        a->release();
+    }
+};
+
+template<> class Snowman::Retrieval<const tArray*, tBlock*> {
+    public:
+    tArray* a;
+    tBlock* b;
+    Retrieval(Snowman* sm, bool consume) {
+        a = sm->retrieve(Variable::ARRAY, consume, 0, true).arrayVal;
+        b = sm->retrieve(Variable::BLOCK, consume, 1).blockVal;
+        if (!consume) { ++a->refs; ++b->refs; }
+    }
+    ~Retrieval() {
+        a->release(); b->release();
     }
 };
 
@@ -50,12 +92,12 @@ template<> class Snowman::Retrieval<tArray*, tArray*> {
     private: bool consume;
     public:
     tArray *a, *b;
-    Retrieval(Snowman* sm, bool consume): consume(consume) {
-        a = sm->retrieve(Variable::ARRAY, consume).arrayVal;
-        b = sm->retrieve(Variable::ARRAY, consume, 1).arrayVal;
+    Retrieval(Snowman* sm, bool consume, bool lazy = false): consume(consume) {
+        a = sm->retrieve(Variable::ARRAY, consume, 0, lazy).arrayVal;
+        b = sm->retrieve(Variable::ARRAY, consume, 1, lazy).arrayVal;
     }
     ~Retrieval() {
-        if (consume) { delete a; delete b; }
+        if (consume) { a->release(); b->release(); }
     }
 };
 
@@ -70,7 +112,7 @@ template<> class Snowman::Retrieval<tArray*, tArray*, tBlock*> {
         c = sm->retrieve(Variable::BLOCK, consume, 2).blockVal;
     }
     ~Retrieval() {
-        if (consume) { delete a; delete b; delete c; }
+        if (consume) { a->release(); b->release(); c->release(); }
     }
 };
 
@@ -84,7 +126,7 @@ template<> class Snowman::Retrieval<tArray*, tArray*, tArray*> {
         c = sm->retrieve(Variable::ARRAY, consume, 2).arrayVal;
     }
     ~Retrieval() {
-        if (consume) { delete a; delete b; delete c; }
+        if (consume) { a->release(); b->release(); c->release(); }
     }
 };
 
@@ -93,12 +135,12 @@ template<> class Snowman::Retrieval<tArray*, tNum> {
     public:
     tArray* a;
     tNum b;
-    Retrieval(Snowman* sm, bool consume): consume(consume) {
-        a = sm->retrieve(Variable::ARRAY, consume).arrayVal;
+    Retrieval(Snowman* sm, bool consume, bool lazy = false): consume(consume) {
+        a = sm->retrieve(Variable::ARRAY, consume, 0, lazy).arrayVal;
         b = sm->retrieve(Variable::NUM, consume, 1).numVal;
     }
     ~Retrieval() {
-        if (consume) delete a;
+        if (consume) a->release();
     }
 };
 
@@ -107,14 +149,14 @@ template<> class Snowman::Retrieval<tArray*, tNum, tNum, tArray*> {
     public:
     tArray *a, *d;
     tNum b, c;
-    Retrieval(Snowman* sm, bool consume): consume(consume) {
-        a = sm->retrieve(Variable::ARRAY, consume).arrayVal;
+    Retrieval(Snowman* sm, bool consume, bool lazy = false): consume(consume) {
+        a = sm->retrieve(Variable::ARRAY, consume, 0, lazy).arrayVal;
         b = sm->retrieve(Variable::NUM, consume, 1).numVal;
         c = sm->retrieve(Variable::NUM, consume, 2).numVal;
-        d = sm->retrieve(Variable::ARRAY, consume, 3).arrayVal;
+        d = sm->retrieve(Variable::ARRAY, consume, 3, lazy).arrayVal;
     }
     ~Retrieval() {
-        if (consume) { delete a; delete d; }
+        if (consume) { a->release(); d->release(); }
     }
 };
 
@@ -126,7 +168,7 @@ template<> class Snowman::Retrieval<tBlock*> {
         a = sm->retrieve(Variable::BLOCK, consume).blockVal;
     }
     ~Retrieval() {
-        if (consume) delete a;
+        if (consume) a->release();
     }
 };
 
@@ -140,7 +182,7 @@ template<> class Snowman::Retrieval<tBlock*, tNum> {
         b = sm->retrieve(Variable::NUM, consume, 1).numVal;
     }
     ~Retrieval() {
-        if (consume) delete a;
+        if (consume) a->release();
     }
 };
 
@@ -153,7 +195,7 @@ template<> class Snowman::Retrieval<tBlock*, tBlock*> {
         b = sm->retrieve(Variable::BLOCK, consume, 1).blockVal;
     }
     ~Retrieval() {
-        if (consume) { delete a; delete b; }
+        if (consume) { a->release(); b->release(); }
     }
 };
 
@@ -168,7 +210,48 @@ template<> class Snowman::Retrieval<tBlock*, tBlock*, Variable> {
         c = sm->retrieve(-1, consume, 2);
     }
     ~Retrieval() {
-        if (consume) { delete a; delete b; c.mm(); }
+        if (consume) { a->release(); b->release(); c.mm(); }
+    }
+};
+
+template<> class Snowman::Retrieval<tDict*> {
+    private: bool consume;
+    public:
+    tDict* a;
+    Retrieval(Snowman* sm, bool consume): consume(consume) {
+        a = sm->retrieve(Variable::DICT, consume).dictVal;
+    }
+    ~Retrieval() {
+        if (consume) a->release();
+    }
+};
+
+template<> class Snowman::Retrieval<tDict*, Variable> {
+    private: bool consume;
+    public:
+    tDict* a;
+    Variable b;
+    Retrieval(Snowman* sm, bool consume): consume(consume) {
+        a = sm->retrieve(Variable::DICT, consume).dictVal;
+        b = sm->retrieve(-1, consume, 1);
+    }
+    ~Retrieval() {
+        if (consume) { a->release(); b.mm(); }
+    }
+};
+
+template<> class Snowman::Retrieval<tDict*, Variable, Variable> {
+    private: bool consume;
+    public:
+    tDict* a;
+    Variable b, c;
+    Retrieval(Snowman* sm, bool consume): consume(consume) {
+        a = sm->retrieve(Variable::DICT, consume).dictVal;
+        b = sm->retrieve(-1, consume, 1);
+        c = sm->retrieve(-1, consume, 2);
+    }
+    ~Retrieval() {
+        if (consume) { a->release(); b.mm(); c.mm(); }
     }
 };
 
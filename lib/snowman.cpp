@@ -2,11 +2,11 @@
 #include "retrieval.hpp"
 #include <iostream>   // std::cout, std::cerr, std::endl
 #include <chrono>     // time stuffs
-#include <cstdlib>    // rand, srand
 #include <cmath>      // abs, fmod, pow, ceil, floor, round
 #include <algorithm>  // find
+#include <unordered_set>  // std::unordered_set
 #include <regex>      // obvious
-// included from snowman.hpp: <vector>, <string>, <map>, <stdexcept>
+// included from snowman.hpp: <vector>, <string>, <stdexcept>
 
 #define DEBUG
 
@@ -25,58 +25,313 @@
     activeVars[1] = b;
 
 const std::string DIGITS = "0123456789abcdefghijklmnopqrstuvwxyz";
+const char DIGIT_PAIRS[] = // "00" "01" ... "99", for printing two at a time
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
 const int TOBASE_PRECISION = 10; // number of digits after decimal point
 const double TOBASE_EPSILON = 0.00001; // if the decimal part is less than
                                        // this, it will be treated as an int
 
+// appends the decimal digits of n
+static void appendDigits(unsigned long long n, std::string& out) {
+    char buf[20], *p = buf + sizeof buf;
+    for (; n >= 100; n /= 100) {
+        p -= 2;
+        memcpy(p, DIGIT_PAIRS + 2 * (n % 100), 2);
+    }
+    if (n >= 10) {
+        p -= 2;
+        memcpy(p, DIGIT_PAIRS + 2 * n, 2);
+    } else {
+        *--p = '0' + n;
+    }
+    out.append(p, buf + sizeof buf - p);
+}
+
+// the value of a digit (in any base up to 36, either case), or -1
+static int digitValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'Z') return c - 'A' + 10;
+    return -1;
+}
+
 // constructor/destructor
-Snowman::Snowman(): activeVars{false}, activePermavar(0),
-        savedActiveState{false}, debugOutput(false) {
-    srand(std::chrono::duration_cast<std::chrono::milliseconds>
+Snowman::Snowman(): script(nullptr), frames(DEFAULT_MAX_DEPTH + 1), depth(0),
+        peakDepth(0), vars(frames[0].vars), activeVars(frames[0].activeVars),
+        permavars(2), activePermavar(0), savedActiveState{false},
+        limited(false), limitHit(false), executed(0), budget(0), safepoints(0),
+        samples(0), in(&std::cin), out(&std::cout), err(&std::cerr),
+        debugOutput(false), debugItems(0), debugDepth(0), debugElide(false),
+        instructionLimit(0), timeLimit(0), memoryLimit(0), limitDump(false),
+        sampleProfile(false), memStats(false), jitThreshold(0) {
+    random.seed(std::chrono::duration_cast<std::chrono::nanoseconds>
         (std::chrono::system_clock::now().time_since_epoch()).count());
 }
-Snowman::~Snowman() {}
+Snowman::~Snowman() {
+    for (auto& c : constants) c.second.mm();
+    if (Heap::current == &heap) Heap::current = nullptr;
+}
 
 // execute string of code
 void Snowman::run(std::string code) {
+    Program prog;
+    SourceMap lines;
+    if (sampleProfile) lines = sourceLines(code);
+    if (!compile(code, prog, &lines)) return;
+    infer(prog);
+    runProgram(prog);
+}
+
+// execute a Script (its blocks are copied from it too, see run(tBlock*))
+void Snowman::run(const Script& s) {
+    if (!s.main) return;
+    Program prog;
+    instantiate(*s.main, prog);
+    infer(prog);
+    script = &s;
+    runProgram(prog);
+    script = nullptr;
+}
+
+// (what's left of a run once the code is compiled)
+void Snowman::runProgram(Program& prog) {
+    // (the limits are for each run, so every line of the REPL starts over)
+    limited = instructionLimit || timeLimit || memoryLimit;
+    limitHit = false;
+    executed = safepoints = 0;
+    budget = instructionLimit ? instructionLimit : -1;
+    started = std::chrono::steady_clock::now();
+    memoryBase = heap.bytes.live;
+    if (sampleProfile) startSampling();
+    heap.tracking = memStats;
+    if (memStats || memoryLimit) Heap::current = &heap;
+    try {
+        safepoint(prog.instructions.size());
+        execute(prog);
+    } catch (SnowmanLimitException& se) {
+        *err << "SnowmanException thrown at run" << std::endl;
+        *err << "  what():  " << se.what() << std::endl;
+        *err << "fatal error, aborting" << std::endl;
+        if (limitDump) *err << debug();
+    }
+    if (sampleProfile) stopSampling();
+    // (the allocations after this, up to the next run, aren't any
+    //   instruction's)
+    heap.leave();
+}
+
+// execute a block (compiled the first time, and then reused every time the
+// same block runs again)
+void Snowman::run(tBlock* blk) {
+    if (!blk->program) {
+        blk->program = new Program;
+        auto translated = translatedBlocks.find(*blk);
+        const Program* compiled = script ? script->block(*blk) : nullptr;
+        if (translated != translatedBlocks.end()) {
+            blk->program->translated = translated->second;
+        } else if (compiled) {
+            instantiate(*compiled, *blk->program);
+            infer(*blk->program);
+        } else if (!compile(*blk, *blk->program, blk->source)) {
+            delete blk->program;
+            blk->program = nullptr;
+            return;
+        } else {
+            infer(*blk->program);
+        }
+    }
+    Program& prog = *blk->program;
+    safepoint(prog.instructions.size());
+    if (prog.translated) {
+        prog.translated(*this);
+        return;
+    }
+    if (jitThreshold && !debugOutput && !sampleProfile &&
+            ++prog.runs >= jitThreshold) {
+        if (!prog.native && !prog.nativeFailed) jitCompile(prog);
+        // falls back to the interpreter if the native code can't handle the
+        //   current state
+        if (prog.native && runNative(prog)) {
+            // (native code can't be unwound through, so a limit it ran into
+            //   is thrown again from here; see jitCall)
+            safepoint(0);
+            return;
+        }
+    }
+    execute(prog);
+}
+
+// convert string of code into a Program (returns false if it couldn't)
+// source is where the code came from, which the sampling profiler needs for
+// every instruction, and for the code of every block literal in turn
+bool Snowman::compile(std::string code, Program& prog,
+        const SourceMap* source) {
     std::vector<std::string> tokens;
+    vvs permavarCount = 0;
+    bool located = sampleProfile && source;
+    std::vector<std::pair<vvs, vvs>> starts;
     try {
-        tokens = Snowman::tokenize(code);
+        tokens = Snowman::tokenize(code, &permavarCount,
+            located ? &starts : nullptr);
     } catch (SnowmanException& se) {
-        std::cerr << "SnowmanException thrown at tokenize" << std::endl;
-        std::cerr << "  what():  " << se.what() << std::endl;
+        *err << "SnowmanException thrown at tokenize" << std::endl;
+        *err << "  what():  " << se.what() << std::endl;
         // all exceptions are fatal because then we have no tokens to run
-        std::cerr << "fatal error, aborting" << std::endl;
-        return;
+        *err << "fatal error, aborting" << std::endl;
+        return false;
     }
+    // make room for every permavar this code can switch to, so that `*' and
+    // `#' can index the table directly
+    if (permavarCount > permavars.size()) permavars.resize(permavarCount);
+    prog.permavarCount = permavarCount;
+    prog.instructions.reserve(tokens.size());
+    vvs offset = 0, next = 0; // (where the token is in starts)
     for (std::string s : tokens) {
-        try {
-            evalToken(s);
-        } catch (SnowmanException& se) {
-            std::cerr << "SnowmanException thrown at evalToken" << std::endl;
-            std::cerr << "  what():  " << se.what() << std::endl;
-            if (se.fatal) {
-                std::cerr << "fatal error, aborting" << std::endl;
-                return;
-            } else {
-                std::cerr << "non-fatal error, continuing" << std::endl;
-                continue;
+        prog.instructions.push_back(decode(s));
+        Instruction& ins = prog.instructions.back();
+        if (!located) {
+            intern(ins, prog.constants);
+            continue;
+        }
+
+        // (identical block literals would share one block, and so one
+        //   source, so each gets its own)
+        intern(ins, prog.constants, ins.type == Instruction::BLOCK ?
+            s + " " + std::to_string(offset) : "");
+        prog.locations.push_back(locate(*source, starts[next++].second));
+        vvs end = offset + s.length();
+        if (ins.type == Instruction::BLOCK) {
+            // (the block's code starts after the `:')
+            tBlock* blk = ins.literal.blockVal;
+            blk->source = new SourceMap;
+            for (; next < starts.size() && starts[next].first < end; ++next) {
+                blk->source->push_back(std::make_pair(
+                    starts[next].first - offset - 1,
+                    locate(*source, starts[next].second)));
             }
         }
-        if (debugOutput) {
-            std::cout << "<[T]> " << s << std::endl;
-            std::cout << "<[D]> " << debug();
+        while (next < starts.size() && starts[next].first < end) ++next;
+        offset = end;
+    }
+    fuse(prog);
+    return true;
+}
+
+void Snowman::execute(const Program& prog) {
+    const std::vector<Instruction>& ins = prog.instructions;
+    // (typed instructions only hold if the program starts out the way it did
+    //   the first time; the debug trace needs the normal path)
+    bool typed = prog.typed && !debugOutput && typedEntry(prog);
+    vvs i = 0;
+    if (sampleProfile) profileStack.push_back(ProfileFrame{&prog, &i});
+    // (undone on the way out, also when a limit exception goes through here
+    //   on its way up to run)
+    struct Restore {
+        Snowman* sm;
+        const Instruction* caller;
+        ~Restore() {
+            if (sm->sampleProfile) sm->profileStack.pop_back();
+            sm->heap.at = caller;
+        }
+    } restore{this, heap.at};
+    for (; i < ins.size(); ++i) {
+        if (memStats) heap.at = &ins[i];
+        if (typed && ins[i].typed) {
+            stepTyped(ins[i]);
+        } else if (ins[i].super) {
+            if (!stepSuper(&ins[i])) break;
+            // (taken before skipping ahead, so it's for the first of them)
+            if (samplesDue) sample();
+            i += ins[i].span - 1;
+            continue;
+        } else if (!step(ins[i])) break;
+        if (samplesDue) sample();
+    }
+}
+
+// execute a single instruction; returns false if execution has to stop
+bool Snowman::step(const Instruction& ins) {
+    try {
+        evalToken(ins);
+    } catch (SnowmanLimitException& se) {
+        // (this one goes all the way up to run)
+        throw;
+    } catch (SnowmanException& se) {
+        *err << "SnowmanException thrown at evalToken" << std::endl;
+        *err << "  what():  " << se.what() << std::endl;
+        if (se.fatal) {
+            *err << "fatal error, aborting" << std::endl;
+            return false;
+        } else {
+            *err << "non-fatal error, continuing" << std::endl;
+            return true;
         }
     }
+    if (debugOutput) {
+        *out << "<[T]> " << ins.token << std::endl;
+        // (the buffer is kept between tokens, so it only allocates when a
+        //   dump is longer than every one before it)
+        debugBuffer.assign("<[D]> ");
+        debug(debugBuffer);
+        *out << debugBuffer;
+    }
+    return true;
 }
 
 // static method to convert string of code into tokens (individual
 // instructions)
-std::vector<std::string> Snowman::tokenize(std::string code) {
+// if permavarCount is given, it is set to the size a permavar table needs to
+// be for every permavar switch in the code
+// if starts is given, every token (and every token inside a block literal) is
+// added to it in order, as where it starts in the tokens joined together and
+// where it started in code
+std::vector<std::string> Snowman::tokenize(std::string code,
+        vvs* permavarCount, std::vector<std::pair<vvs, vvs>>* starts) {
     std::vector<std::string> tokens;
     std::string token;
+    vvs start = 0, joined = 0; // (of token in code; of tokens joined together)
     bool comment = false, blockComment = false, prevCloseBracket = false,
          escaping = false;
+
+    // a block literal becomes a single token: the tokens inside it, joined
+    // together. they're appended to blockText as they come (inner blocks
+    // included), with the offset of every token in marks and the offset of
+    // every open `:' in blockStarts, so closing a block doesn't have to copy
+    // anything that's already in it
+    std::string blockText;
+    std::vector<vvs> marks, blockStarts;
+    auto emit = [&](const std::string& t) {
+        if (starts) {
+            starts->push_back(std::make_pair(joined + blockText.length(),
+                start));
+        }
+        if (blockStarts.empty()) {
+            tokens.push_back(t);
+            joined += t.length();
+        } else {
+            marks.push_back(blockText.length());
+            blockText += t;
+        }
+    };
+    auto lastIs = [&](char c) {
+        if (blockStarts.empty()) {
+            return tokens.size() > 0 && tokens.back().length() == 1 &&
+                tokens.back()[0] == c;
+        }
+        return blockText.length() - marks.back() == 1 && blockText.back() == c;
+    };
+    auto popLast = [&]() {
+        if (starts) starts->pop_back();
+        if (blockStarts.empty()) {
+            joined -= tokens.back().length();
+            tokens.pop_back();
+        } else {
+            blockText.resize(marks.back());
+            marks.pop_back();
+        }
+    };
+
     for (char& c : code) {
         if (comment) {
             if (c == '\n') comment = false;
@@ -99,7 +354,7 @@ std::vector<std::string> Snowman::tokenize(std::string code) {
         }
 
         if (token[0] >= '0' && token[0] <= '9' && !(c >= '0' && c <= '9')) {
-            tokens.push_back(token);
+            emit(token);
             token = "";
         }
 
@@ -110,7 +365,7 @@ std::vector<std::string> Snowman::tokenize(std::string code) {
             // two-letter operator in progress
             if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
                 token += c;
-                tokens.push_back(token);
+                emit(token);
                 token = "";
             } else {
                 throw SnowmanException("at tokenize: letter operator "
@@ -121,7 +376,7 @@ std::vector<std::string> Snowman::tokenize(std::string code) {
             if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
                 token += c;
                 if (token.length() == 3) {
-                    tokens.push_back(token);
+                    emit(token);
                     token = "";
                 }
             } else {
@@ -136,7 +391,7 @@ std::vector<std::string> Snowman::tokenize(std::string code) {
                     token.erase(token.length() - 2, 1); // get rid of backslash
                     escaping = false;
                 } else {
-                    tokens.push_back(token);
+                    emit(token);
                     token = "";
                 }
             } else if (c == '\\') {
@@ -151,7 +406,10 @@ std::vector<std::string> Snowman::tokenize(std::string code) {
             // permavar switch in progress
             token += c;
             if ((c == '+') || (c == '!')) {
-                tokens.push_back(token);
+                if (permavarCount && (token.length() * 2 > *permavarCount)) {
+                    *permavarCount = token.length() * 2;
+                }
+                emit(token);
                 token = "";
             } else if (c != '=') {
                 throw SnowmanException("at tokenize: invalid permavar name?",
@@ -159,6 +417,7 @@ std::vector<std::string> Snowman::tokenize(std::string code) {
             }
         } else if (token.length() == 0) {
             // nothing currently in progress; start new token
+            start = &c - &code[0];
             if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
                     (c >= 'A' && c <= 'Z') || (c == '"') || (c == '=')) {
                 // some token that is longer than one character
@@ -168,41 +427,48 @@ std::vector<std::string> Snowman::tokenize(std::string code) {
                 // single character token
                 // (printable ascii is already guaranteed from if-continue
                 //  above)
-                if ((c == '/') && (tokens.size() > 0) &&
-                        (tokens[tokens.size()-1] == "/")) {
+                if ((c == '/') && lastIs('/')) {
                     // comment
-                    tokens.pop_back();
+                    popLast();
                     comment = true;
-                } else if ((c == '[') && (tokens.size() > 0) &&
-                        (tokens[tokens.size()-1] == "[")) {
+                } else if ((c == '[') && lastIs('[')) {
                     // block comment
-                    tokens.pop_back();
+                    popLast();
                     blockComment = true;
-                } else if ((c == '(') && (tokens.size() > 0) &&
-                        (tokens[tokens.size()-1] == "(")) {
+                } else if ((c == '(') && lastIs('(')) {
                     // subroutine start
-                    tokens.pop_back();
-                    tokens.push_back("((");
-                } else if ((c == ')') && (tokens.size() > 0) &&
-                        (tokens[tokens.size()-1] == ")")) {
+                    if (starts) start = starts->back().second;
+                    popLast();
+                    emit("((");
+                } else if ((c == ')') && lastIs(')')) {
                     // subroutine end
-                    tokens.pop_back();
-                    tokens.push_back("))");
+                    if (starts) start = starts->back().second;
+                    popLast();
+                    emit("))");
+                } else if (c == ':') {
+                    // start block literal
+                    blockStarts.push_back(blockText.length());
+                    emit(":");
                 } else if (c == ';') {
                     // end block literal
-                    std::string blk = ";", t;
-                    while ((t = tokens.back()) != ":") {
-                        blk = t + blk;
-                        tokens.pop_back();
-                        if (tokens.size() == 0) {
-                            throw SnowmanException("at tokenize: invalid "
-                                "block nesting?", true);
-                        }
+                    if (blockStarts.empty()) {
+                        throw SnowmanException("at tokenize: invalid "
+                            "block nesting?", true);
+                    }
+                    vvs start = blockStarts.back();
+                    blockStarts.pop_back();
+                    blockText += ';';
+                    // (the whole block is a single token now)
+                    while (marks.back() > start) marks.pop_back();
+                    if (blockStarts.empty()) {
+                        tokens.push_back(blockText);
+                        joined += blockText.length();
+                        blockText.clear();
+                        marks.clear();
                     }
-                    tokens[tokens.size()-1] += blk;
                 } else {
                     token += c;
-                    tokens.push_back(token);
+                    emit(token);
                     token = "";
                 }
             }
@@ -211,106 +477,186 @@ std::vector<std::string> Snowman::tokenize(std::string code) {
                 "value?", true);
         }
     }
-    if (token.length() != 0) tokens.push_back(token);
+    if (token.length() != 0) emit(token);
+    // blocks that are never closed stay separate tokens
+    for (vvs i = 0; i < marks.size(); ++i) {
+        vvs end = i + 1 < marks.size() ? marks[i+1] : blockText.length();
+        tokens.push_back(blockText.substr(marks[i], end - marks[i]));
+    }
     return tokens;
 }
 
-// execute an individual token (called in a loop over all tokens)
-void Snowman::evalToken(std::string token) {
-    // used for letter operators, 2nd and 3rd if blocks below
-    // (initialized to false because compiler warnings)
-    bool consume = false;
+// static method to decode a token, so that none of this has to be redone
+// every time the token is executed
+Instruction Snowman::decode(std::string token) {
+    Instruction ins;
+    ins.type = Instruction::OPERATOR;
+    ins.token = token;
+    ins.op = 0;
+    ins.consume = false;
+    ins.num = 0;
+    ins.numLow = 0;
+    ins.permavar = 0;
+    ins.fatal = false;
+    ins.super = 0;
+    ins.span = 1;
+    ins.typed = false;
+    ins.args[0] = ins.args[1] = ins.dest = -1;
     if (token[0] >= '0' && token[0] <= '9') {
-        // store literal number
-        int num;
+        // literal number
+        ins.type = Instruction::NUMBER;
         try {
-            num = std::stoi(token);
+            Variable v = exactNum(std::stoll(token));
+            ins.num = v.numVal;
+            ins.numLow = v.numLow;
         } catch (const std::invalid_argument& e) {
-            store(Variable(0.0));
-            throw SnowmanException("at evalToken: invalid number " + token +
-                "? using 0 instead", false);
+            ins.error = "at evalToken: invalid number " + token +
+                "? using 0 instead";
         } catch (const std::out_of_range& e) {
-            store(Variable(0.0));
-            throw SnowmanException("at evalToken: number " + token + " out of "
-                "range, using 0 instead", false);
+            ins.error = "at evalToken: number " + token + " out of range, "
+                "using 0 instead";
         }
-        store(Variable((tNum)num));
-        return;
+        return ins;
     } else if (token.length() == 2 && token[0] >= 'a' && token[0] <= 'z') {
         // two-letter operator
         if (token[1] >= 'A' && token[1] <= 'Z') {
-            consume = true;
+            ins.consume = true;
             // convert to lowercase
             token[1] = token[1] + ('a' - 'A');
         } else {
-            consume = false;
+            ins.consume = false;
         }
         // handled further below
     } else if (token.length() == 3 && token[0] >= 'A' && token[0] <= 'Z') {
         // three-letter operator
         if ((token[1] >= 'a' && token[1] <= 'z') &&
                 (token[2] >= 'A' && token[2] <= 'Z')) {
-            consume = true;
+            ins.consume = true;
             // convert to all uppercase
             token[1] = token[1] - ('a' - 'A');
         } else if ((token[1] >= 'A' && token[1] <= 'Z') &&
                 (token[2] >= 'a' && token[2] <= 'z')) {
-            consume = false;
+            ins.consume = false;
             // convert to all uppercase
             token[2] = token[2] - ('a' - 'A');
         } else {
-            throw SnowmanException("at evalToken: bad letter function "
-                "capitalization, ignoring token", false);
+            ins.type = Instruction::INVALID;
+            ins.error = "at evalToken: bad letter function capitalization, "
+                "ignoring token";
+            return ins;
         }
         // handled further below
     } else if (token.length() >= 2 && token[0] == '"') {
-        // store literal string-array
-        auto arr = new tArray(token.length() - 2);
-        for (vvs i = 1; i < token.length() - 1; ++i) {
-            (*arr)[i-1] = Variable((tNum)token[i]);
-        }
-        store(Variable(arr));
-        return;
+        // literal string-array
+        ins.type = Instruction::STRING;
+        ins.str = token.substr(1, token.length() - 2);
+        return ins;
     } else if (token.length() >= 2 && token[0] == ':') {
-        // store literal block
-        auto str = new std::string(token.substr(1, token.length() - 2));
-        store(Variable(str));
-        return;
+        // literal block
+        ins.type = Instruction::BLOCK;
+        ins.str = token.substr(1, token.length() - 2);
+        return ins;
     } else if ((token[0] == '=') || (token[0] == '+') || (token[0] == '!')) {
         // switch permavar
-        activePermavar = (token.length()-1) * 2 +
+        ins.type = Instruction::PERMAVAR;
+        ins.permavar = (token.length()-1) * 2 +
             (token[token.length()-1] == '!');
-        return;
+        return ins;
     } else if (token == "((") {
-        VarState vs;
-        std::memcpy(vs.vars, vars, sizeof(Variable)*8);
-        std::memcpy(vs.activeVars, activeVars, sizeof(bool)*8);
-        std::fill(std::begin(vars), std::end(vars), Variable());
-        std::fill(std::begin(activeVars), std::end(activeVars), false);
-        subroutines.push_back(vs);
-        return;
+        ins.type = Instruction::SUB_START;
+        return ins;
     } else if (token == "))") {
-        if (subroutines.size() == 0) {
-            throw SnowmanException("at evalToken: no subroutines left on "
-                "stack, ignoring `))' instruction", false);
-        }
-        VarState vs = subroutines.back();
-        std::memcpy(vars, vs.vars, sizeof(Variable)*8);
-        std::memcpy(activeVars, vs.activeVars, sizeof(bool)*8);
-        subroutines.pop_back();
-        return;
+        ins.type = Instruction::SUB_END;
+        return ins;
     } else if (token.length() == 1 && token[0] >= '!' && token[0] <= '~') {
         // handled below
     } else {
-        throw SnowmanException("at evalToken: unrecognized token?", true);
+        ins.type = Instruction::INVALID;
+        ins.error = "at evalToken: unrecognized token?";
+        ins.fatal = true;
+        return ins;
     }
 
-    // compute a hash for each token, so that we can use a switch statement
-    // below. see also #define'd HSH1, HSH2, and HSH3
-    long token_hsh = 0;
+    // compute a hash for each operator, so that we can use a switch statement
+    // in evalToken. see also #define'd HSH1, HSH2, and HSH3
     for (char& ch : token) {
-        token_hsh *= 256;
-        token_hsh += ch;
+        ins.op *= 256;
+        ins.op += ch;
+    }
+    return ins;
+}
+
+// give a string or block literal its value, so that running it only has to
+// share that instead of building a new array or block every time (and a block
+// is then only compiled once, however often it runs). the pool keeps a
+// reference, so the value is copied before anything modifies it; identical
+// literals share one value (unless they're given different keys)
+void Snowman::intern(Instruction& ins, std::map<std::string, Variable>& pool,
+        const std::string& key) {
+    if (ins.type != Instruction::STRING && ins.type != Instruction::BLOCK) {
+        return;
+    }
+    Variable& v = pool[key.empty() ? ins.token : key];
+    if (v.type == Variable::UNDEFINED) {
+        if (ins.type == Instruction::STRING) {
+            auto arr = new tArray;
+            arr->form = tArray::DENSE;
+            arr->nums.assign(ins.str.begin(), ins.str.end());
+            v = Variable(arr);
+        } else {
+            v = Variable(new tBlock(ins.str));
+        }
+    }
+    ins.literal = v;
+}
+
+// execute an individual token (called in a loop over all tokens)
+void Snowman::evalToken(const Instruction& ins) {
+    bool consume = ins.consume; // used for letter operators
+    switch (ins.type) {
+    case Instruction::OPERATOR:
+        // handled below
+        break;
+    case Instruction::NUMBER:
+        store(Variable(ins.num, ins.numLow));
+        if (!ins.error.empty()) throw SnowmanException(ins.error, false);
+        return;
+    case Instruction::STRING:
+    case Instruction::BLOCK:
+        store(ins.literal.share());
+        return;
+    case Instruction::PERMAVAR:
+        activePermavar = ins.permavar;
+        return;
+    case Instruction::SUB_START:
+        // frames are preallocated and always left clean, so entering a
+        // subroutine only has to point vars/activeVars at the next one
+        if (depth + 1 >= frames.size()) {
+            throw SnowmanException("at evalToken: maximum subroutine depth "
+                "exceeded, stopping execution", true);
+        }
+        ++depth;
+        if (depth > peakDepth) peakDepth = depth;
+        vars = frames[depth].vars;
+        activeVars = frames[depth].activeVars;
+        return;
+    case Instruction::SUB_END:
+        if (depth == 0) {
+            throw SnowmanException("at evalToken: no subroutines left on "
+                "stack, ignoring `))' instruction", false);
+        }
+        // drop whatever the subroutine left behind
+        for (int i = 0; i < 8; ++i) {
+            vars[i].mm();
+            vars[i] = Variable();
+            activeVars[i] = false;
+        }
+        --depth;
+        vars = frames[depth].vars;
+        activeVars = frames[depth].activeVars;
+        return;
+    case Instruction::INVALID:
+        throw SnowmanException(ins.error, ins.fatal);
     }
 
     // and now, time for...
@@ -320,7 +666,7 @@ void Snowman::evalToken(std::string token) {
     Variable v; // for variable operators (ROT2, ROT3)
     bool b; // for active variable rotation operators (ROT_ACT)
 
-    switch (token_hsh) {
+    switch (ins.op) {
 
     /// Rotation operators
     case HSH1('/'): /// cf
@@ -382,76 +728,83 @@ void Snowman::evalToken(std::string token) {
 
     /// Permavar operators
     case HSH1('*'): /// retrieve a value, set the current permavar's value to this
-        permavars[activePermavar] = retrieve(-1, true, -1);
+        v = retrieve(-1, true, -1, true);
+        usePermavar();
+        permavars[activePermavar].mm();
+        permavars[activePermavar] = v;
         break;
     case HSH1('#'): /// store the current permavar's value
-        store(permavars[activePermavar].copy());
+        // shared rather than copied; anything that modifies an array in place
+        //   checks whether it is shared first
+        usePermavar();
+        store(permavars[activePermavar].share());
         break;
 
     /// Number operators
     case HSH3('N','D','E'): { /// (n) -> n: decrement
         Retrieval<tNum> r(this, consume);
-        store(Variable(r.a - 1));
+        store(arith('-', r.a, r.aLow, 1, 0, r.a - 1));
         break;
     }
     case HSH3('N','I','N'): { /// (n) -> n: increment
         Retrieval<tNum> r(this, consume);
-        store(Variable(r.a + 1));
+        store(arith('+', r.a, r.aLow, 1, 0, r.a + 1));
         break;
     }
     case HSH3('N','A','B'): { /// (n) -> n: absolute value
         Retrieval<tNum> r(this, consume);
-        store(Variable(r.a < 0 ? -r.a : r.a));
+        store(r.a < 0 ? arith('-', 0, 0, r.a, r.aLow, -r.a) :
+            Variable(r.a, r.aLow));
         break;
     }
     case HSH2('n','f'): { /// (n) -> n: floor
         Retrieval<tNum> r(this, consume);
-        store(Variable(floor(r.a)));
+        store(Variable(floor(r.a), r.aLow));
         break;
     }
     case HSH2('n','c'): { /// (n) -> n: ceiling
         Retrieval<tNum> r(this, consume);
-        store(Variable(ceil(r.a)));
+        store(Variable(ceil(r.a), r.aLow));
         break;
     }
     case HSH3('N','R','O'): { /// (n) -> n: round
         Retrieval<tNum> r(this, consume);
-        store(Variable(round(r.a)));
+        store(Variable(round(r.a), r.aLow));
         break;
     }
     case HSH3('N','B','N'): { /// (n) -> n: bitwise NOT
         Retrieval<tNum> r(this, consume);
-        store(Variable((tNum) ~((int)round(r.a))));
+        store(exactNum(~toInt(r.a, r.aLow)));
         break;
     }
     case HSH3('N','B','O'): { /// (nn) -> n: bitwise OR
         Retrieval<tNum, tNum> r(this, consume);
-        store(Variable((tNum) (((int)round(r.a)) | ((int)round(r.b)))));
+        store(exactNum(toInt(r.a, r.aLow) | toInt(r.b, r.bLow)));
         break;
     }
     case HSH3('N','B','A'): { /// (nn) -> n: bitwise AND
         Retrieval<tNum, tNum> r(this, consume);
-        store(Variable((tNum) (((int)round(r.a)) & ((int)round(r.b)))));
+        store(exactNum(toInt(r.a, r.aLow) & toInt(r.b, r.bLow)));
         break;
     }
     case HSH3('N','B','X'): { /// (nn) -> n: bitwise XOR
         Retrieval<tNum, tNum> r(this, consume);
-        store(Variable((tNum) (((int)round(r.a)) ^ ((int)round(r.b)))));
+        store(exactNum(toInt(r.a, r.aLow) ^ toInt(r.b, r.bLow)));
         break;
     }
     case HSH2('n','a'): { /// (nn) -> n: addition
         Retrieval<tNum, tNum> r(this, consume);
-        store(Variable(r.a + r.b));
+        store(arith('+', r.a, r.aLow, r.b, r.bLow, r.a + r.b));
         break;
     }
     case HSH2('n','s'): { /// (nn) -> n: subtraction
         Retrieval<tNum, tNum> r(this, consume);
-        store(Variable(r.a - r.b));
+        store(arith('-', r.a, r.aLow, r.b, r.bLow, r.a - r.b));
         break;
     }
     case HSH2('n','m'): { /// (nn) -> n: multiplication
         Retrieval<tNum, tNum> r(this, consume);
-        store(Variable(r.a * r.b));
+        store(arith('*', r.a, r.aLow, r.b, r.bLow, r.a * r.b));
         break;
     }
     case HSH2('n','d'): { /// (nn) -> n: division
@@ -461,25 +814,38 @@ void Snowman::evalToken(std::string token) {
     }
     case HSH3('N','M','O'): { /// (nn) -> n: modulo
         Retrieval<tNum, tNum> r(this, consume);
-        store(Variable(fmod(r.a, r.b)));
+        store(arith('%', r.a, r.aLow, r.b, r.bLow, modulo(r.a, r.b)));
         break;
     }
     case HSH2('n','l'): { /// (nn) -> n: less than
         Retrieval<tNum, tNum> r(this, consume);
-        store(Variable((tNum)(r.a < r.b)));
+        store(Variable((tNum)numLess(r.a, r.aLow, r.b, r.bLow)));
         break;
     }
     case HSH2('n','g'): { /// (nn) -> n: greater than
         Retrieval<tNum, tNum> r(this, consume);
-        store(Variable((tNum)(r.a > r.b)));
+        store(Variable((tNum)numLess(r.b, r.bLow, r.a, r.aLow)));
         break;
     }
     case HSH2('n','r'): { /// (nn) -> n: range
         Retrieval<tNum, tNum> r(this, consume);
         auto arr = new tArray;
         bool rev = (r.a > r.b);
-        for (tNum i = r.a; rev ? (i > r.b) : (i < r.b); i += (rev ? -1 : 1)) {
-            arr->push_back(Variable(i));
+        tNum len = rev ? ceil(r.a - r.b) : (r.a < r.b ? ceil(r.b - r.a) : 0);
+        if (r.a == floor(r.a) && fabs(r.a) + len < 9007199254740992.0) {
+            // (every element is an exact integer, so the lazy array can
+            //   compute them without the repeated additions below)
+            arr->form = tArray::RANGE;
+            arr->count = len;
+            arr->from = r.a;
+            arr->reverse = rev;
+        } else {
+            arr->form = tArray::DENSE;
+            if (len < 9007199254740992.0) arr->nums.reserve(len);
+            for (tNum i = r.a; rev ? (i > r.b) : (i < r.b);
+                    i += (rev ? -1 : 1)) {
+                arr->nums.push_back(i);
+            }
         }
         store(Variable(arr));
         break;
@@ -492,20 +858,30 @@ void Snowman::evalToken(std::string token) {
     case HSH2('n','b'): { /// (nn) -> a: to base
         Retrieval<tNum, tNum> r(this, consume);
         // convert integer part
-        int n = floor(r.a), base = round(r.b);
+        long long i = toInt(floor(r.a), r.aLow);
+        int base = round(r.b);
         if (base <= 0) {
             throw SnowmanException("at nb: negative or 0 base, stopping "
                 "execution of nb", false);
         }
-        bool neg = n < 0;
-        if (neg) n = -n;
+        bool neg = i < 0;
+        // (the magnitude is unsigned, so negating the smallest value is fine)
+        unsigned long long n = neg ? 0 - (unsigned long long)i : i;
         std::string nb;
-        while (n) {
-            nb = DIGITS[n % base] + nb;
-            n /= base;
+        if (neg) nb += '-';
+        if (base == 10 || n == 0) {
+            appendDigits(n, nb);
+        } else {
+            // (digits come out last first)
+            ss start = nb.length();
+            if ((base & (base - 1)) == 0) {
+                int shift = __builtin_ctz(base);
+                for (; n; n >>= shift) nb += DIGITS[n & (base - 1)];
+            } else {
+                for (; n; n /= base) nb += DIGITS[n % base];
+            }
+            std::reverse(nb.begin() + start, nb.end());
         }
-        if (neg) nb = '-' + nb;
-        if (nb.empty()) nb = "0";
         // convert decimal part
         tNum decimalPart = r.a - floor(r.a);
         if (decimalPart > TOBASE_EPSILON) {
@@ -521,41 +897,104 @@ void Snowman::evalToken(std::string token) {
         store(stringToArr(nb));
         break;
     }
+    case HSH3('N','R','A'): { /// (n) -> a: array of that many random numbers [0,1)
+        Retrieval<tNum> r(this, consume);
+        // (one operator for the whole batch, instead of one vr per number)
+        vvs n = r.a > 0 ? round(r.a) : 0;
+        auto arr = new tArray;
+        arr->form = tArray::DENSE;
+        arr->nums.resize(n);
+        for (tNum& x : arr->nums) x = random.real();
+        store(Variable(arr));
+        break;
+    }
 
     /// Array operators
     case HSH3('A','S','O'): { /// (a) -> a: sort
-        Retrieval<tArray*> r(this, consume);
-        std::sort(r.a->begin(), r.a->end());
-        store(Variable(new tArray(*r.a)));
+        Retrieval<tArray*> r(this, consume, true);
+        // shared arrays can't be modified in place (copy-on-write)
+        tArray* arr = r.a->refs > 1 ? new tArray(*r.a) : r.a;
+        if (arr->densify()) {
+            // (sorting plain doubles is a lot faster)
+            std::sort(arr->nums.begin(), arr->nums.end());
+        } else {
+            arr->materialize();
+            std::sort(arr->begin(), arr->end());
+        }
+        arr->changed();
+        if (arr != r.a) {
+            store(Variable(arr));
+        } else if (consume) {
+            // (the consumed array is the result; it just needs to outlive
+            //   the Retrieval)
+            store(Variable(arr).share());
+        } else {
+            store(Variable(new tArray(*arr)));
+        }
         break;
     }
     case HSH3('A','S','B'): { /// (ab) -> a: sort by
-        Retrieval<tArray*, std::string*> r(this, consume);
-        std::sort(r.a->begin(), r.a->end(),
+        Retrieval<tArray*, tBlock*> r(this, consume);
+        // (a copy, if it's shared, is held until it's stored)
+        Owned<tArray> copy(r.a->refs > 1 ? new tArray(*r.a) : nullptr);
+        tArray* arr = copy.get() ? copy.get() : r.a;
+        std::sort(arr->begin(), arr->end(),
             [&] (Variable const& a, Variable const& b) {
-                store(a);
-                store(b);
-                run(*r.b);
+                store(a.share());
+                store(b.share());
+                run(r.b);
                 return Retrieval<bool>(this).b;
             });
-        store(Variable(new tArray(*r.a)));
+        arr->changed();
+        store(Variable(copy.get() ? copy.take() : new tArray(*arr)));
         break;
     }
     case HSH2('a','f'): { /// (ab) -> *: fold
-        Retrieval<tArray*, std::string*> r(this, consume);
-        if (r.a->size() == 0) {
+        Retrieval<const tArray*, tBlock*> r(this, consume);
+        Variable result;
+        // (a fold can only be done natively if the block gets to combine the
+        //   elements in the first two active variables, and isn't traced)
+        if (consume && !debugOutput && reduce(*r.a, *r.b, result)) {
+            store(result);
+        } else if (r.a->length() == 0) {
             store(Variable(0.0));  // this is just arbitrary
         } else {
-            store((*r.a)[0]);
-            for (vvs i = 1; i < r.a->size(); ++i) {
-                store((*r.a)[i]);
-                run(*r.b);
+            store(r.a->element(0).share());
+            for (vvs i = 1; i < r.a->length(); ++i) {
+                store(r.a->element(i).share());
+                run(r.b);
             }
         }
         break;
     }
     case HSH2('a','c'): { /// (aa) -> a: concatenate arrays
-        Retrieval<tArray*, tArray*> r(this, consume);
+        Retrieval<tArray*, tArray*> r(this, consume, true);
+        if (consume && r.a->refs == 1 && (r.a->form == tArray::EAGER ||
+                r.a->form == tArray::DENSE)) {
+            // a consumed array that nothing else shares is appended to in
+            //   place
+            if (r.a->form == tArray::DENSE && r.b->numbers()) {
+                r.b->appendNums(r.a->nums);
+            } else {
+                r.a->materialize();
+                r.b->materialize();
+                r.a->insert(r.a->end(), r.b->begin(), r.b->end());
+            }
+            r.a->changed();
+            store(Variable(r.a).share());
+            break;
+        }
+        if (r.a->numbers() && r.b->numbers()) {
+            auto arr = new tArray;
+            arr->form = tArray::DENSE;
+            arr->nums.reserve(r.a->length() + r.b->length());
+            r.a->appendNums(arr->nums);
+            r.b->appendNums(arr->nums);
+            store(Variable(arr));
+            break;
+        }
+        r.a->materialize();
+        r.b->materialize();
         int s1 = r.a->size(), s2 = r.b->size();
         auto arr = new tArray(s1 + s2);
         for (int i = 0; i < s1; ++i) (*arr)[i] = (*r.a)[i];
@@ -566,10 +1005,10 @@ void Snowman::evalToken(std::string token) {
     case HSH2('a','d'): { /// (aa) -> a: array/set difference
         Retrieval<tArray*, tArray*> r(this, consume);
         auto arr = new tArray;
+        std::unordered_set<Variable, VariableHash> remove(r.b->begin(),
+            r.b->end());
         for (vvs i = 0; i < r.a->size(); ++i) {
-            if (std::find(r.b->begin(), r.b->end(), (*r.a)[i]) == r.b->end()) {
-                arr->push_back((*r.a)[i]);
-            }
+            if (!remove.count((*r.a)[i])) arr->push_back((*r.a)[i]);
         }
         store(Variable(arr));
         break;
@@ -577,15 +1016,12 @@ void Snowman::evalToken(std::string token) {
     case HSH3('A','O','R'): { /// (aa) -> a: setwise or
         Retrieval<tArray*, tArray*> r(this, consume);
         auto arr = new tArray;
+        std::unordered_set<Variable, VariableHash> seen;
         for (Variable v : *r.a) {
-            if (std::find(arr->begin(), arr->end(), v) == arr->end()) {
-                arr->push_back(v);
-            }
+            if (seen.insert(v).second) arr->push_back(v);
         }
         for (Variable v : *r.b) {
-            if (std::find(arr->begin(), arr->end(), v) == arr->end()) {
-                arr->push_back(v);
-            }
+            if (seen.insert(v).second) arr->push_back(v);
         }
         store(Variable(arr));
         break;
@@ -593,10 +1029,10 @@ void Snowman::evalToken(std::string token) {
     case HSH3('A','A','N'): { /// (aa) -> a: setwise and
         Retrieval<tArray*, tArray*> r(this, consume);
         auto arr = new tArray;
+        std::unordered_set<Variable, VariableHash> keep(r.b->begin(),
+            r.b->end()), seen;
         for (vvs i = 0; i < r.a->size(); ++i) {
-            if (std::find(r.b->begin(), r.b->end(), (*r.a)[i]) != r.b->end() &&
-                    std::find(arr->begin(), arr->end(), (*r.a)[i]) ==
-                    arr->end()) {
+            if (keep.count((*r.a)[i]) && seen.insert((*r.a)[i]).second) {
                 arr->push_back((*r.a)[i]);
             }
         }
@@ -604,11 +1040,14 @@ void Snowman::evalToken(std::string token) {
         break;
     }
     case HSH2('a','r'): { /// (an) -> a: array repeat
-        Retrieval<tArray*, tNum> r(this, consume);
+        Retrieval<tArray*, tNum> r(this, consume, true);
         if (r.b < 0) r.b = 0;
-        auto arr = new tArray(r.a->size() * r.b);
-        for (vvs i = 0; i < r.a->size() * r.b; ++i) {
-            (*arr)[i] = (*r.a)[i % r.a->size()];
+        auto arr = new tArray;
+        if (r.a->length()) {
+            arr->form = tArray::REPEAT;
+            arr->count = r.a->length() * r.b;
+            arr->source = r.a;
+            ++r.a->refs;
         }
         store(Variable(arr));
         break;
@@ -630,19 +1069,20 @@ void Snowman::evalToken(std::string token) {
     }
     case HSH2('a','s'): { /// (aa) -> a: split
         Retrieval<tArray*, tArray*> r(this, consume);
-        auto arr = new tArray, tmp = new tArray;
+        Owned<tArray> arr(new tArray), tmp(new tArray);
         for (vvs i = 0; i < r.a->size(); ++i) {
-            if ((*r.b) == tArray(r.a->begin() + i,
-                    r.a->begin() + i + r.b->size())) {
-                arr->push_back(Variable(tmp));
-                tmp = new tArray;
+            // (compared where it is, without copying that part of the array)
+            if (r.b->size() <= r.a->size() - i && std::equal(r.b->begin(),
+                    r.b->end(), r.a->begin() + i)) {
+                arr->push_back(Variable(tmp.take()));
+                tmp.reset(new tArray);
                 i += r.b->size() - 1;
             } else {
                 tmp->push_back((*r.a)[i]);
             }
         }
-        arr->push_back(Variable(tmp));
-        store(Variable(arr));
+        arr->push_back(Variable(tmp.take()));
+        store(Variable(arr.take()));
         break;
     }
     case HSH2('a','g'): { /// (an) -> a: split array in groups of size
@@ -652,43 +1092,51 @@ void Snowman::evalToken(std::string token) {
             throw SnowmanException("at ag: negative or 0 n, stopping "
                 "execution of az", false);
         }
-        auto arr = new tArray, tmp = new tArray;
+        Owned<tArray> arr(new tArray), tmp(new tArray);
         for (vvs i = 0; i < r.a->size(); ++i) {
             tmp->push_back((*r.a)[i]);
             if (i % n == (n-1)) {
-                arr->push_back(Variable(tmp));
-                tmp = new tArray;
+                arr->push_back(Variable(tmp.take()));
+                tmp.reset(new tArray);
             }
         }
-        if (tmp->size()) arr->push_back(Variable(tmp));
-        else delete tmp;
-        store(Variable(arr));
+        if (tmp->size()) arr->push_back(Variable(tmp.take()));
+        store(Variable(arr.take()));
         break;
     }
     case HSH2('a','e'): { /// (ab) -> -: each
-        Retrieval<tArray*, std::string*> r(this, consume);
-        for (Variable v : *r.a) {
-            store(v);
-            run(*r.b);
+        Retrieval<const tArray*, tBlock*> r(this, consume);
+        for (vvs i = 0; i < r.a->length(); ++i) {
+            store(r.a->element(i).share());
+            run(r.b);
         }
         break;
     }
     case HSH2('a','m'): { /// (ab) -> a: map
-        Retrieval<tArray*, std::string*> r(this, consume);
-        auto arr = new tArray;
-        for (Variable v : *r.a) {
-            store(v);
-            run(*r.b);
+        Retrieval<const tArray*, tBlock*> r(this, consume);
+        Owned<tArray> arr(new tArray);
+        arr->form = tArray::DENSE;
+        arr->nums.reserve(r.a->length());
+        for (vvs i = 0; i < r.a->length(); ++i) {
+            store(r.a->element(i).share());
+            run(r.b);
             Retrieval<Variable> r2(this, true);
-            arr->push_back(r2.a.copy());
+            arr->append(r2.a.copy());
         }
-        store(Variable(arr));
+        store(Variable(arr.take()));
         break;
     }
     case HSH2('a','n'): { /// (an) -> a: every nth element (negative n = reverse)
-        Retrieval<tArray*, tNum> r(this, consume);
+        Retrieval<tArray*, tNum> r(this, consume, true);
         int n = round(r.b);
         bool rev = n < 0;
+        vvs len = r.a->length();
+        if (n != 0) {
+            vvs count = len ? (len - 1) / std::abs(n) + 1 : 0;
+            store(Variable(r.a->slice(rev ? len - 1 : 0, count, n)));
+            break;
+        }
+        r.a->materialize();
         auto arr = new tArray;
         for (int i = (rev ? (r.a->size()-1) : 0); rev ? (i >= 0) :
                 (((vvs)i) < r.a->size()); i += n) {
@@ -698,11 +1146,13 @@ void Snowman::evalToken(std::string token) {
         break;
     }
     case HSH3('A','S','E'): { /// (ab) -> a: select
-        Retrieval<tArray*, std::string*> r(this, consume);
-        auto arr = new tArray;
-        for (Variable v : *r.a) {
-            store(v);
-            run(*r.b);
+        Retrieval<const tArray*, tBlock*> r(this, consume);
+        Owned<tArray> arr(new tArray);
+        arr->form = tArray::DENSE;
+        for (vvs i = 0; i < r.a->length(); ++i) {
+            Variable v = r.a->element(i);
+            store(v.share());
+            run(r.b);
             // WARNING: do *not* try to "optimize" this into
             //   if (Retrieval<bool>(this).b) ...
             // that fails on some edge-cases, such as
@@ -712,83 +1162,147 @@ void Snowman::evalToken(std::string token) {
             // destructor gets called *before* v.copy() is run, and the pointer
             // that v refers to has already been delete'd
             Retrieval<bool> r2(this);
-            if (r2.b) arr->push_back(v.copy());
+            if (r2.b) arr->append(v.copy());
         }
-        store(Variable(arr));
+        store(Variable(arr.take()));
         break;
     }
     case HSH3('A','S','I'): { /// (ab) -> a: select by index / index of / find index
-        Retrieval<tArray*, std::string*> r(this, consume);
-        auto arr = new tArray;
-        for (vvs i = 0; i < r.a->size(); ++i) {
-            Variable v = (*r.a)[i];
-            store(v);
-            run(*r.b);
-            if (Retrieval<bool>(this).b) arr->push_back(Variable((tNum)i));
+        Retrieval<const tArray*, tBlock*> r(this, consume);
+        Owned<tArray> arr(new tArray);
+        arr->form = tArray::DENSE;
+        for (vvs i = 0; i < r.a->length(); ++i) {
+            Variable v = r.a->element(i);
+            store(v.share());
+            run(r.b);
+            if (Retrieval<bool>(this).b) arr->nums.push_back(i);
         }
-        store(Variable(arr));
+        store(Variable(arr.take()));
         break;
     }
     case HSH3('A','A','L'): { /// (an) -> a: elements at indeces less than n
-        Retrieval<tArray*, tNum> r(this, consume);
+        Retrieval<tArray*, tNum> r(this, consume, true);
         vvs n = round(r.b);
-        auto arr = new tArray;
-        for (vvs i = 0; i < r.a->size() && i < n; ++i) arr->push_back((*r.a)[i]);
-        store(Variable(arr));
+        store(Variable(r.a->slice(0, std::min(n, r.a->length()), 1)));
         break;
     }
     case HSH3('A','A','G'): { /// (an) -> a: elements at indeces greater than n
-        Retrieval<tArray*, tNum> r(this, consume);
+        Retrieval<tArray*, tNum> r(this, consume, true);
         int n = round(r.b);
-        auto arr = new tArray;
-        for (vvs i = n + 1; i < r.a->size(); ++i) arr->push_back((*r.a)[i]);
-        store(Variable(arr));
+        vvs start = n + 1, len = r.a->length();
+        store(Variable(r.a->slice(start, start < len ? len - start : 0, 1)));
         break;
     }
     case HSH2('a','a'): { /// (an) -> *: element at index
-        Retrieval<tArray*, tNum> r(this, consume);
-        try {
-            store(r.a->at((int)r.b));
-        } catch (std::out_of_range& oor) {
+        Retrieval<tArray*, tNum> r(this, consume, true);
+        vvs i = (int)r.b;
+        if (i < r.a->length()) {
+            store(r.a->element(i).share());
+        } else {
             store(Variable(0.0));  // this is just arbitrary
         }
         break;
     }
     case HSH2('a','l'): { /// (a) -> n: array length
-        Retrieval<tArray*> r(this, consume);
-        store(Variable((tNum)r.a->size()));
+        Retrieval<const tArray*> r(this, consume);
+        store(Variable((tNum)r.a->length()));
         break;
     }
     case HSH2('a','z'): { /// (a) -> a: zip/transpose
         Retrieval<tArray*> r(this, consume);
-        auto arr = new tArray;
-        // sanity check, also get max size
-        vvs maxSize = 0;
-        for (vvs i = 0; i < r.a->size(); ++i) {
+        Owned<tArray> arr(new tArray);
+        // sanity check, also get max size (and how many rows are longer than
+        //   each index, which is how long each row of the result will be)
+        vvs n = r.a->size(), maxSize = 0;
+        bool numbers = true, dense = true;
+        std::vector<const tArray*> rows(n);
+        for (vvs i = 0; i < n; ++i) {
             if ((*r.a)[i].type != Variable::ARRAY) {
                 throw SnowmanException("at az: array elements are not arrays, "
                         "stopping execution of az", false);
             }
-            if ((*r.a)[i].arrayVal->size() > maxSize) {
-                maxSize = (*r.a)[i].arrayVal->size();
-            }
+            rows[i] = (*r.a)[i].arrayVal;
+            if (rows[i]->length() > maxSize) maxSize = rows[i]->length();
+            numbers = numbers && rows[i]->numbers();
+            dense = dense && rows[i]->form == tArray::DENSE;
         }
-        // fill arr now
+        std::vector<vvs> longer(maxSize + 1);
+        for (const tArray* row : rows) ++longer[row->length()];
+        for (vvs j = maxSize; j > 0; --j) longer[j-1] += longer[j];
+        bool rectangular = n && longer[maxSize] == n;
+        // fill arr now (rows of numbers come out dense)
+        arr->reserve(maxSize);
         for (vvs j = 0; j < maxSize; ++j) {
             auto tmp = new tArray;
-            for (vvs i = 0; i < r.a->size(); ++i) {
-                if ((*r.a)[i].arrayVal->size() > j) {
-                    tmp->push_back((*(*r.a)[i].arrayVal)[j]);
-                }
+            if (numbers) {
+                tmp->form = tArray::DENSE;
+                tmp->nums.reserve(longer[j+1]);
+            } else {
+                tmp->reserve(longer[j+1]);
             }
             arr->push_back(Variable(tmp));
         }
-        store(Variable(arr));
+        if (dense && rectangular) {
+            // (in tiles, so that both sides stay in cache)
+            const vvs TILE = 32;
+            for (vvs j = 0; j < maxSize; ++j) {
+                (*arr)[j].arrayVal->nums.resize(n);
+            }
+            for (vvs i0 = 0; i0 < n; i0 += TILE) {
+                for (vvs j0 = 0; j0 < maxSize; j0 += TILE) {
+                    for (vvs i = i0; i < n && i < i0 + TILE; ++i) {
+                        const tNum* row = rows[i]->nums.data();
+                        for (vvs j = j0; j < maxSize && j < j0 + TILE; ++j) {
+                            (*arr)[j].arrayVal->nums[i] = row[j];
+                        }
+                    }
+                }
+            }
+        } else {
+            for (const tArray* row : rows) {
+                for (vvs j = 0; j < row->length(); ++j) {
+                    (*arr)[j].arrayVal->append(row->element(j));
+                }
+            }
+        }
+        store(Variable(arr.take()));
         break;
     }
     case HSH3('A','S','P'): { /// (anna) -> a: splice (first argument is array to splice, second is start index, third is length, fourth is what to replace with)
-        Retrieval<tArray*, tNum, tNum, tArray*> r(this, consume);
-        vvs idx = round(r.b), len = round(r.c);
+        Retrieval<tArray*, tNum, tNum, tArray*> r(this, consume, true);
+        vvs idx = round(r.b), len = round(r.c), size = r.a->length(),
+            head = std::min(idx, size), tail = idx + len;
+        bool cut = r.d->length() == 0 && (tail >= size || head == 0);
+        if (consume && r.a->refs == 1 && idx <= tail &&
+                (r.a->form == tArray::EAGER || r.a->form == tArray::DENSE) &&
+                !(cut && tail < size)) {
+            // a consumed array that nothing else shares is spliced in place
+            //   (unless only its start is cut off, which a slice does
+            //   without moving the rest)
+            vvs end = std::min(tail, size);
+            if (r.a->form == tArray::DENSE && r.d->densify()) {
+                r.a->nums.erase(r.a->nums.begin() + head,
+                    r.a->nums.begin() + end);
+                r.a->nums.insert(r.a->nums.begin() + head, r.d->nums.begin(),
+                    r.d->nums.end());
+            } else {
+                r.a->materialize();
+                r.d->materialize();
+                r.a->erase(r.a->begin() + head, r.a->begin() + end);
+                r.a->insert(r.a->begin() + head, r.d->begin(), r.d->end());
+            }
+            r.a->changed();
+            store(Variable(r.a).share());
+            break;
+        }
+        if (cut) {
+            // (only cutting off the start or the end leaves a slice)
+            if (tail >= size) store(Variable(r.a->slice(0, head, 1)));
+            else store(Variable(r.a->slice(tail, size - tail, 1)));
+            break;
+        }
+        r.a->materialize();
+        r.d->materialize();
         auto arr = new tArray;
         for (vvs i = 0; i < idx && i < r.a->size(); ++i) {
             arr->push_back((*r.a)[i]);
@@ -801,37 +1315,32 @@ void Snowman::evalToken(std::string token) {
         break;
     }
     case HSH3('A','F','L'): { /// (an) -> a: flatten (number is how many "layers" to flatten; 0 means completely flatten the array)
-        Retrieval<tArray*, tNum> r(this, consume);
-        int count = round(r.b);
-        bool infinite = (count == 0), changed = true;
-        while ((changed) && (infinite || count--)) {
-            changed = false;
-            tArray arr;
-            for (Variable v : *r.a) {
-                if (v.type == Variable::ARRAY) {
-                    changed = true;
-                    for (Variable v2 : *v.arrayVal) {
-                        arr.push_back(v2);
-                    }
-                } else {
-                    arr.push_back(v);
-                }
-            }
-            *r.a = arr;
-        }
-        store(Variable(new tArray(*r.a)));
+        Retrieval<tArray*, tNum> r(this, consume, true);
+        tArray* flat = r.a->flatten(round(r.b));
+        // (an array that isn't shared is flattened where it is)
+        if (r.a->refs == 1 && !consume) *r.a = *flat;
+        store(Variable(flat));
         break;
     }
     case HSH3('A','S','H'): { /// (a) -> a: shuffle array
-        Retrieval<tArray*> r(this, consume);
-        std::random_shuffle(r.a->begin(), r.a->end());
-        store(Variable(new tArray(*r.a)));
+        Retrieval<tArray*> r(this, consume, true);
+        tArray* arr = r.a->refs > 1 ? new tArray(*r.a) : r.a;
+        if (arr->densify()) {
+            // (as with aso, plain doubles are a lot faster to move around)
+            random.shuffle(arr->nums.data(),
+                arr->nums.data() + arr->nums.size());
+        } else {
+            arr->materialize();
+            random.shuffle(arr->data(), arr->data() + arr->size());
+        }
+        arr->changed();
+        store(Variable(arr == r.a ? new tArray(*arr) : arr));
         break;
     }
 
     /// "String" operators
     case HSH2('s','b'): { /// (an) -> n: from-base from array-"string"
-        Retrieval<tArray*, tNum> r(this, consume);
+        Retrieval<tArray*, tNum> r(this, consume, true);
         std::string str = arrToString(*r.a);
         int base = round(r.b);
         tNum num = 0;
@@ -846,23 +1355,34 @@ void Snowman::evalToken(std::string token) {
             str.erase(dotPos, 1);
             subPos = dotPos - 1;
         }
-        for (int i = str.length() - 1; i >= 0; --i) {
-            char c = (str[i] >= 'A' && str[i] <= 'Z') ? str[i] + ('a' - 'A') :
-                str[i];
-            ss digit = DIGITS.find(c);
-            if ((digit == std::string::npos) || (digit >= (ss) base)) {
-                num = 0;
-                break;
-            } else {
-                num += digit * pow(base, subPos - i);
+        // any digit that isn't one makes the whole thing 0
+        bool valid = true;
+        for (char c : str) {
+            int digit = digitValue(c);
+            if (digit < 0 || (ss) digit >= (ss) base) valid = false;
+        }
+        if (valid && base >= 2 && dotPos == std::string::npos) {
+            // integers are read left to right in one pass (exact as long as
+            //   they stay below 2^53, so they come out the same as the sum
+            //   of powers below)
+            for (char c : str) {
+                num = num * base + digitValue(c);
+                if (num >= 9007199254740992.0) break;
+            }
+        }
+        if (valid && (base < 2 || dotPos != std::string::npos ||
+                num >= 9007199254740992.0)) {
+            num = 0;
+            for (int i = str.length() - 1; i >= 0; --i) {
+                num += digitValue(str[i]) * pow(base, subPos - i);
             }
         }
         store(Variable(num * (neg ? -1 : 1)));
         break;
     }
     case HSH2('s','p'): { /// (a) -> -: print an array-"string"
-        Retrieval<tArray*> r(this, consume);
-        std::cout << arrToString(*r.a);
+        Retrieval<tArray*> r(this, consume, true);
+        *out << arrToString(*r.a);
         break;
     }
 #ifndef OMIT_REGEX
@@ -900,7 +1420,7 @@ void Snowman::evalToken(std::string token) {
         break;
     }
     case HSH3('S','R','B'): { /// (aab) -> a: same as `sr` but with a block instead of array-"string"
-        Retrieval<tArray*, tArray*, std::string*> r(this, consume);
+        Retrieval<tArray*, tArray*, tBlock*> r(this, consume);
         std::string str = arrToString(*r.a);
         std::regex rgx;
         try {
@@ -909,7 +1429,6 @@ void Snowman::evalToken(std::string token) {
             throw SnowmanException("at srb: regex error, stopping execution of "
                 "srb", false);
         }
-        std::string repl = *r.c;
         auto rb = std::sregex_token_iterator(str.begin(), str.end(), rgx, {-1,0}),
              re = std::sregex_token_iterator();
         std::string result;
@@ -917,7 +1436,7 @@ void Snowman::evalToken(std::string token) {
         for (auto it = rb; it != re; ++it) {
             if (isMatch) {
                 store(stringToArr(*it));
-                run(repl);
+                run(r.c);
                 Retrieval<tArray*> r2(this, true);
                 result += arrToString(*r2.a);
             } else {
@@ -930,37 +1449,91 @@ void Snowman::evalToken(std::string token) {
     }
 #endif
 
+    /// Dictionary operators
+    case HSH2('d','g'): { /// (d*) -> *: value for a key (0 if the key isn't there)
+        Retrieval<tDict*, Variable> r(this, consume);
+        const Variable* v = r.a->get(r.b);
+        store(v ? v->share() : Variable(0.0));  // (0 is arbitrary, as in aa)
+        break;
+    }
+    case HSH2('d','s'): { /// (d**) -> d: set the value for a key (first argument is dictionary, second is key, third is value)
+        Retrieval<tDict*, Variable, Variable> r(this, consume);
+        // (a consumed dictionary that nothing else shares is changed in
+        //   place, like ac does with arrays)
+        tDict* dict = consume && r.a->refs == 1 ? r.a : new tDict(*r.a);
+        dict->set(r.b.share(), r.c.share());
+        store(dict == r.a ? Variable(dict).share() : Variable(dict));
+        break;
+    }
+    case HSH2('d','d'): { /// (d*) -> d: delete a key
+        Retrieval<tDict*, Variable> r(this, consume);
+        tDict* dict = consume && r.a->refs == 1 ? r.a : new tDict(*r.a);
+        dict->erase(r.b);
+        store(dict == r.a ? Variable(dict).share() : Variable(dict));
+        break;
+    }
+    case HSH2('d','h'): { /// (d*) -> n: has key?
+        Retrieval<tDict*, Variable> r(this, consume);
+        store(Variable((tNum)(r.a->get(r.b) != nullptr)));
+        break;
+    }
+    case HSH2('d','k'): { /// (d) -> a: keys (in the order they were added)
+        Retrieval<tDict*> r(this, consume);
+        auto arr = new tArray;
+        arr->form = tArray::DENSE;
+        for (const tDict::Entry& e : r.a->entries) {
+            if (e.key.type != Variable::UNDEFINED) arr->append(e.key.share());
+        }
+        store(Variable(arr));
+        break;
+    }
+    case HSH2('d','v'): { /// (d) -> a: values (in the same order as dk)
+        Retrieval<tDict*> r(this, consume);
+        auto arr = new tArray;
+        arr->form = tArray::DENSE;
+        for (const tDict::Entry& e : r.a->entries) {
+            if (e.key.type != Variable::UNDEFINED) arr->append(e.value.share());
+        }
+        store(Variable(arr));
+        break;
+    }
+    case HSH2('d','l'): { /// (d) -> n: number of keys
+        Retrieval<tDict*> r(this, consume);
+        store(Variable((tNum)r.a->size()));
+        break;
+    }
+
     /// Block operators
     case HSH2('b','r'): { /// (bn) -> -: repeat
-        Retrieval<std::string*, tNum> r(this, consume);
-        for (int i = 0; i < round(r.b); ++i) run(*r.a);
+        Retrieval<tBlock*, tNum> r(this, consume);
+        for (int i = 0; i < round(r.b); ++i) run(r.a);
         break;
     }
     case HSH2('b','w'): { /// (bb) -> -: while ("returned" value from second block is simply first non-undefined active variable, which is set to undefined after reading it)
-        Retrieval<std::string*, std::string*> r(this, consume);
+        Retrieval<tBlock*, tBlock*> r(this, consume);
         while (1) {
-            run(*r.b);
+            run(r.b);
             if (!Retrieval<bool>(this).b) break;
-            run(*r.a);
+            run(r.a);
         }
         break;
     }
     case HSH2('b','i'): { /// (bb*) -> -: if/else
-        Retrieval<std::string*, std::string*, Variable> r(this, consume);
-        if (Snowman::toBool(r.c)) run(*r.a);
-        else run(*r.b);
+        Retrieval<tBlock*, tBlock*, Variable> r(this, consume);
+        if (Snowman::toBool(r.c)) run(r.a);
+        else run(r.b);
         break;
     }
     case HSH2('b','d'): { /// (b) -> -: do (`:...;bD` is basically the same as `:;:...;bW`)
-        Retrieval<std::string*> r(this, consume);
+        Retrieval<tBlock*> r(this, consume);
         do {
-            run(*r.a);
+            run(r.a);
         } while (Retrieval<bool>(this).b);
         break;
     }
     case HSH2('b','e'): { /// (b) -> -: execute / evaluate
-        Retrieval<std::string*> r(this, consume);
-        run(*r.a);
+        Retrieval<tBlock*> r(this, consume);
+        run(r.a);
         break;
     }
 
@@ -994,24 +1567,7 @@ void Snowman::evalToken(std::string token) {
     }
     case HSH2('e','q'): { /// (**) -> n: equal?
         Retrieval<Variable, Variable> r(this, consume);
-        if (r.a.type != r.b.type) {
-            store(Variable(0.0));
-        } else {
-            switch (r.a.type) {
-            case Variable::UNDEFINED:
-                store(Variable(1.0));
-                break;
-            case Variable::NUM:
-                store(Variable((tNum)(r.a.numVal == r.b.numVal)));
-                break;
-            case Variable::ARRAY:
-                store(Variable((tNum)((*r.a.arrayVal) == (*r.b.arrayVal))));
-                break;
-            case Variable::BLOCK:
-                store(Variable((tNum)((*r.a.blockVal) == (*r.b.blockVal))));
-                break;
-            }
-        }
+        store(Variable((tNum)equal(r.a, r.b)));
         break;
     }
     case HSH2('d','u'): { /// (*) -> **: duplicate
@@ -1026,12 +1582,12 @@ void Snowman::evalToken(std::string token) {
         break;
     case HSH2('v','g'): { /// (-) -> a: get line of input (as an array-"string")
         std::string line;
-        std::getline(std::cin, line);
+        std::getline(*in, line);
         store(stringToArr(line));
         break;
     }
     case HSH2('v','r'): /// (-) -> n: random number [0,1)
-        store(Variable((tNum)rand() / RAND_MAX));
+        store(Variable(random.real()));
         break;
     case HSH2('v','t'): /// (-) -> n: time (milliseconds since epoch)
         store(Variable((tNum)std::chrono::duration_cast
@@ -1041,6 +1597,9 @@ void Snowman::evalToken(std::string token) {
     case HSH2('v','a'): /// (-) -> a: get command line args
         store(Variable(new tArray(args)));
         break;
+    case HSH2('v','d'): /// (-) -> d: new empty dictionary
+        store(Variable(new tDict));
+        break;
 
     default:
         throw SnowmanException("at evalToken: unrecognized token?", true);
@@ -1059,13 +1618,14 @@ void Snowman::store(Variable val) {
     val.mm();
 }
 
-Variable Snowman::retrieve(int type, bool consume, int skip) {
+Variable Snowman::retrieve(int type, bool consume, int skip, bool lazy) {
     // for definition of "retrieve", see doc/snowman.md
     // (also used for gathering letter operator arguments)
     // default value of consume is true
     // default value of skip is 0
     // if skip is -1, any amount of variables will be skipped (ex. retrieve(-1,
     //   false, -1) will get you the first non-undefined variable)
+    // lazy arrays are materialized unless lazy is true (default false)
     for (int i = 0; i < 8; ++i) {
         if (activeVars[i]) {
             if (skip > 0) {
@@ -1074,6 +1634,9 @@ Variable Snowman::retrieve(int type, bool consume, int skip) {
             }
             if ((vars[i].type != Variable::UNDEFINED) &&
                     (type == -1 || vars[i].type == type)) {
+                if (!lazy && vars[i].type == Variable::ARRAY) {
+                    vars[i].arrayVal->materialize();
+                }
                 if (consume) {
                     Variable v = vars[i];
                     vars[i].type = Variable::UNDEFINED;
@@ -1092,10 +1655,61 @@ Variable Snowman::retrieve(int type, bool consume, int skip) {
         "execution of operator", true);
 }
 
-std::string Snowman::arrToString(tArray arr) {
+tArray* tArray::flatten(int layers) const {
+    // nested arrays are gone through with a stack instead of recursion, so
+    //   any depth works. the first pass counts the elements and checks
+    //   whether they're all numbers, so the second can allocate exactly
+    struct Frame { const tArray* arr; vvs i; int layers; };
+    auto flat = new tArray;
+    vvs total = 0;
+    bool numbers = true;
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1 && numbers) {
+            flat->form = DENSE;
+            flat->nums.reserve(total);
+        } else if (pass == 1) {
+            flat->reserve(total);
+        }
+        // (layers < 0 means no limit, which is what 0 asked for)
+        std::vector<Frame> stack(1, Frame{this, 0, layers > 0 ? layers : -1});
+        while (!stack.empty()) {
+            Frame& f = stack.back();
+            if (f.i == f.arr->length()) {
+                stack.pop_back();
+                continue;
+            }
+            Variable v = f.arr->element(f.i++);
+            if (v.type == Variable::ARRAY && f.layers != 0) {
+                const tArray* sub = v.arrayVal;
+                int subLayers = f.layers > 0 ? f.layers - 1 : -1;
+                if (sub->form == DENSE) {
+                    // (nothing further down to flatten)
+                    if (pass == 0) total += sub->nums.size();
+                    else if (numbers) sub->appendNums(flat->nums);
+                    else for (tNum x : sub->nums) flat->push_back(Variable(x));
+                } else {
+                    stack.push_back(Frame{sub, 0, subLayers});
+                }
+            } else if (pass == 0) {
+                ++total;
+                numbers = numbers && v.type == Variable::NUM;
+            } else {
+                flat->append(v);
+            }
+        }
+    }
+    return flat;
+}
+
+std::string Snowman::arrToString(const tArray& arr) {
     // convert std::vector<Variable[.type==Variable::NUM]> to std::string
     std::string s;
-    for (Variable v : arr) {
+    if (arr.form == tArray::DENSE) {
+        s.assign(arr.nums.begin(), arr.nums.end());
+        return s;
+    }
+    for (vvs i = 0; i < arr.length(); ++i) {
+        Variable v = arr.element(i);
         if (v.type == Variable::NUM) {
             s += (char)v.numVal;
         } else {
@@ -1107,32 +1721,90 @@ std::string Snowman::arrToString(tArray arr) {
 
 Variable Snowman::stringToArr(std::string str) {
     auto arr = new tArray;
-    for (char& c : str) {
-        arr->push_back(Variable((tNum)c));
-    }
+    arr->form = tArray::DENSE;
+    arr->nums.assign(str.begin(), str.end());
     return Variable(arr);
 }
 
 std::string Snowman::inspect(Variable v) {
+    std::string s;
+    inspect(v, s);
+    return s;
+}
+
+// (appends to out, so that arrays are written into one string)
+void Snowman::inspect(const Variable& v, std::string& out) {
+    inspect(v, out, 0, -1);
+}
+
+// arrays and dictionaries longer than 2*items (unless items is 0) only show
+//   the first and last items elements, with ... in between; ones nested
+//   deeper than depth (unless it's negative) are only shown as [...] or <...>
+void Snowman::inspect(const Variable& v, std::string& out, vvs items,
+        int depth) {
     switch (v.type) {
     case Variable::UNDEFINED:
-        return "";
+        break;
     case Variable::NUM: {
-        char buf[64];
-        sprintf(buf, "%.*G", 16, v.numVal);
-        return std::string(buf);
+        long long n;
+        if (exactInt(v.numVal, v.numLow, n)) {
+            // integers that fit in 64 bits are printed directly, with all
+            //   their digits (%.16G would round ones past 16 digits)
+            if (std::signbit(v.numVal)) out += '-';
+            appendDigits(n < 0 ? 0 - (unsigned long long)n : n, out);
+        } else {
+            char buf[64];
+            sprintf(buf, "%.*G", 16, v.numVal);
+            out += buf;
+        }
+        break;
     }
     case Variable::ARRAY: {
-        std::string s = "[";
-        for (Variable v2 : *v.arrayVal) {
-            s += Snowman::inspect(v2) + " ";
+        if (depth == 0) {
+            out += "[...]";
+            break;
         }
-        if (s.length() == 1) s = "[]";
-        else s[s.length()-1] = ']';
-        return s;
+        vvs n = v.arrayVal->length();
+        bool cut = items && n > 2 * items;
+        out += '[';
+        for (vvs i = 0; i < n; ++i) {
+            if (cut && i == items) {
+                out += " ...";
+                i = n - items;
+            }
+            if (i) out += ' ';
+            inspect(v.arrayVal->element(i), out, items, depth - 1);
+        }
+        out += ']';
+        break;
     }
     case Variable::BLOCK:
-        return ":" + (*v.blockVal) + ";";
+        out += ':';
+        out += *v.blockVal;
+        out += ';';
+        break;
+    case Variable::DICT: {
+        if (depth == 0) {
+            out += "<...>";
+            break;
+        }
+        vvs n = v.dictVal->size(), i = 0;
+        bool cut = items && n > 2 * items;
+        out += '<';
+        for (const tDict::Entry& e : v.dictVal->entries) {
+            if (e.key.type == Variable::UNDEFINED) continue;
+            if (cut && i >= items && i < n - items) {
+                if (i++ == items) out += " ...";
+                continue;
+            }
+            if (i++) out += ' ';
+            inspect(e.key, out, items, depth - 1);
+            out += '=';
+            inspect(e.value, out, items, depth - 1);
+        }
+        out += '>';
+        break;
+    }
     default: throw SnowmanException("at inspect: impossible type?", true);
     }
 }
@@ -1144,29 +1816,213 @@ bool Snowman::toBool(Variable v) {
     case Variable::NUM:
         return v.numVal != 0;
     case Variable::ARRAY:
-        return (*v.arrayVal).size() != 0;
+        return (*v.arrayVal).length() != 0;
     case Variable::BLOCK:
         return (*v.blockVal).size() != 0;
+    case Variable::DICT:
+        return v.dictVal->size() != 0;
     default: throw SnowmanException("at toBool: impossible type?", true);
     }
 }
 
+// (see arith in snowman.hpp) the doubles' result r stands whenever either
+// number isn't a 64-bit integer, or the exact result isn't one either
+Variable exactArith(char op, tNum a, int aLow, tNum b, int bLow, tNum r) {
+    long long x, y, z;
+    if (!exactInt(a, aLow, x) || !exactInt(b, bLow, y)) return Variable(r);
+    bool overflow = false;
+    switch (op) {
+    case '+': overflow = __builtin_add_overflow(x, y, &z); break;
+    case '-': overflow = __builtin_sub_overflow(x, y, &z); break;
+    case '*': overflow = __builtin_mul_overflow(x, y, &z); break;
+    default /* % */:
+        if (y == 0) return Variable(r);
+        // (the smallest integer % -1 would overflow the division)
+        z = y == -1 ? 0 : x % y;
+        break;
+    }
+    if (overflow) return Variable(r);
+    // (a zero keeps the sign the doubles would give it)
+    if (z == 0) return Variable(copysign(0.0, op == '%' ? a : r));
+    return exactNum(z);
+}
+
+bool equal(const Variable& a, const Variable& b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+    case Variable::UNDEFINED:
+        return true;
+    case Variable::NUM:
+        return a.numVal == b.numVal && a.numLow == b.numLow;
+    case Variable::ARRAY: {
+        // (arrays whose cached hashes differ can't be equal, so most unequal
+        //   arrays aren't compared element by element)
+        const tArray &x = *a.arrayVal, &y = *b.arrayVal;
+        if (x.length() != y.length() || x.hash() != y.hash()) return false;
+        if (x.form == tArray::EAGER && y.form == tArray::EAGER) return x == y;
+        // (the keys of a dictionary can be in any form)
+        for (vvs i = 0; i < x.length(); ++i) {
+            if (!(x.element(i) == y.element(i))) return false;
+        }
+        return true;
+    }
+    case Variable::BLOCK:
+        return a.blockVal->size() == b.blockVal->size() &&
+            a.blockVal->hash() == b.blockVal->hash() &&
+            *a.blockVal == *b.blockVal;
+    case Variable::DICT: {
+        if (a.dictVal == b.dictVal) return true;
+        if (a.dictVal->size() != b.dictVal->size()) return false;
+        for (const tDict::Entry& e : a.dictVal->entries) {
+            if (e.key.type == Variable::UNDEFINED) continue;
+            const Variable* v = b.dictVal->get(e.key);
+            if (!v || !equal(e.value, *v)) return false;
+        }
+        return true;
+    }
+    default: throw SnowmanException("at equal: impossible type?", true);
+    }
+}
+
+size_t equalHash(const Variable& v) {
+    switch (v.type) {
+    case Variable::ARRAY: return v.arrayVal->hash();
+    case Variable::BLOCK: return v.blockVal->hash();
+    // (the same for any two dictionaries of the same size, which is all
+    //   that can be said without depending on the order of the entries)
+    case Variable::DICT: return hashBits(v.dictVal->size());
+    default: return v.hash();
+    }
+}
+
 std::string Snowman::debug() {
     std::string s;
+    debug(s);
+    return s;
+}
+
+// (appends to out)
+void Snowman::debug(std::string& out) {
+    int maxDepth = debugDepth ? (int)debugDepth : -1;
+    if (debugElide && shown.size() < 8 + permavars.size()) {
+        shown.resize(8 + permavars.size());
+    }
+
     for (int i = 0; i < 8; ++i) {
-        s += "{" + (activeVars[i] ? std::string("*") : std::string("")) + " " +
-            Snowman::inspect(vars[i]) + " } ";
+        out += '{';
+        if (activeVars[i]) out += '*';
+        out += ' ';
+        if (debugElide && unchanged(vars[i], shown[i])) out += "(same)";
+        else inspect(vars[i], out, debugItems, maxDepth);
+        out += " } ";
+    }
+
+    for (vvs i = 0; i < permavars.size(); ++i) {
+        if (i >= permavarsUsed.size() || !permavarsUsed[i]) continue;
+        out.append(i / 2, '=');
+        out += i % 2 == 0 ? "+=" : "!=";
+        if (debugElide && unchanged(permavars[i], shown[8 + i])) {
+            out += "(same)";
+        } else {
+            inspect(permavars[i], out, debugItems, maxDepth);
+        }
+        out += ' ';
     }
 
-    for (const auto& pv : permavars) {
-        s += std::string(pv.first / 2, '=') + (pv.first % 2 == 0 ? "+" : "!") +
-            "=" + Snowman::inspect(pv.second) + " ";
+    if (peakDepth > 0) {
+        out += "((depth=" + std::to_string(depth) + " peak=" +
+            std::to_string(peakDepth) + ")) ";
     }
 
-    s[s.length()-1] = '\n';
-    return s;
+    out[out.length()-1] = '\n';
+}
+
+// whether an array, block or dictionary is the same one as at the last call
+//   (for the same slot), with the same contents. the contents are compared
+//   by hash, which for arrays is cached until they're changed in place, so
+//   a big array that stays the same isn't gone through again. numbers are
+//   never elided, since they're as short as "(same)" anyway
+bool Snowman::unchanged(const Variable& v, Shown& last) {
+    Shown now = {nullptr, 0, 0};
+    switch (v.type) {
+    case Variable::ARRAY:
+        now = {v.arrayVal, v.arrayVal->length(), v.arrayVal->hash()};
+        break;
+    case Variable::BLOCK:
+        now = {v.blockVal, v.blockVal->size(), v.blockVal->hash()};
+        break;
+    case Variable::DICT:
+        now = {v.dictVal, v.dictVal->size(), 0};
+        for (const tDict::Entry& e : v.dictVal->entries) {
+            if (e.key.type == Variable::UNDEFINED) continue;
+            now.hash = (now.hash * 31 + equalHash(e.key)) * 31 + e.value.hash();
+        }
+        break;
+    default:
+        break;
+    }
+    bool same = now.value && now.value == last.value &&
+        now.length == last.length && now.hash == last.hash;
+    last = now;
+    return same;
 }
 
 void Snowman::addArg(std::string arg) {
     args.push_back(stringToArr(arg));
 }
+
+// decode a token for generated C++ code (which never calls compile, so the
+// permavar table is grown and literals are interned here instead)
+Instruction Snowman::instruction(std::string token) {
+    Instruction ins = decode(token);
+    intern(ins, constants);
+    if (ins.type == Instruction::PERMAVAR &&
+            (vvs)ins.permavar >= permavars.size()) {
+        permavars.resize(ins.permavar + 1);
+    }
+    return ins;
+}
+
+void Snowman::addTranslatedBlock(std::string code, TranslatedBlock fn) {
+    translatedBlocks[code] = fn;
+}
+
+void Snowman::checkLimits() {
+    if (!limitHit && executed > budget) {
+        limitHit = true;
+        throw SnowmanLimitException("at run: instruction limit reached, "
+            "stopping execution");
+    }
+    if (!limitHit && timeLimit && std::chrono::duration_cast
+            <std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+            started).count() >= (long long)timeLimit) {
+        limitHit = true;
+        throw SnowmanLimitException("at run: time limit reached, stopping "
+            "execution");
+    }
+    // (unlike the peak, this goes back down when memory is freed, so an
+    //   earlier run that used a lot doesn't count against this one)
+    if (!limitHit && memoryLimit && (heap.bytes.live - memoryBase) /
+            (1024 * 1024) >= (long long)memoryLimit) {
+        limitHit = true;
+        throw SnowmanLimitException("at run: memory limit reached, stopping "
+            "execution");
+    }
+    if (limitHit) {
+        // (every enclosing block that's still running stops too)
+        throw SnowmanLimitException("at run: limit reached, stopping "
+            "execution");
+    }
+}
+
+void Snowman::seed(unsigned long long s) {
+    random.seed(s);
+}
+
+void Snowman::setMaxDepth(vvs maxDepth) {
+    // can't drop frames that are currently in use
+    if (maxDepth < depth) maxDepth = depth;
+    frames.resize(maxDepth + 1);
+    vars = frames[depth].vars;
+    activeVars = frames[depth].activeVars;
+}
@@ -2,19 +2,27 @@
 #define __SNOWMAN_HPP__
 
 #include <stdexcept>
+#include <algorithm>
+#include <cmath>
 #include <vector>
 #include <cstring>
+#include <string>
 #include <map>
+#include <unordered_map>
+#include <chrono>
+#include <csignal>
+#include <iosfwd>
 
 struct Variable;
+struct tArray;
+struct tBlock;
+struct tDict;
+struct Program;
+struct Instruction;
+class Snowman;
 
 typedef bool tUndefined;
 typedef double tNum;
-typedef std::vector<Variable> tArray;
-typedef std::string tBlock;
-
-typedef tArray::size_type vvs;
-typedef tBlock::size_type ss;
 
 class SnowmanException: public std::runtime_error {
     public:
@@ -23,13 +31,97 @@ class SnowmanException: public std::runtime_error {
         bool fatal;
 };
 
+// thrown when a run goes over one of its limits (see Snowman::safepoint).
+//   other fatal errors only stop the block they happen in, but this one stops
+//   the whole run
+class SnowmanLimitException: public SnowmanException {
+    public:
+        SnowmanLimitException(std::string msg): SnowmanException(msg, true) {}
+};
+
+// accounting for what a Snowman allocates while its memStats or memoryLimit
+//   is on (see heap.cpp): the bytes of every allocation on the thread (only
+//   where countsBytes), and with memStats, every array, block and
+//   dictionary, with the operator that made it, so that the ones nothing can
+//   reach anymore can be found
+struct Heap {
+    enum Kind { ARRAY, BLOCK, DICT };
+    struct Count {
+        long long live = 0, peak = 0;
+        unsigned long long total = 0;
+        // (total only counts what's added)
+        void add(long long n) {
+            if (n > 0) total += n;
+            if ((live += n) > peak) peak = live;
+        }
+    };
+    Count values[3];  // (by Kind)
+    Count bytes;
+
+    // what was allocated while each operator (by token) was executed
+    struct Site {
+        unsigned long long values = 0, bytes = 0;
+    };
+    std::map<std::string, Site> sites;
+
+    // every array, block and dictionary that's still around
+    struct Value {
+        Kind kind;
+        const std::string* site;
+    };
+    std::unordered_map<const void*, Value> live;
+
+    // whether values and sites are counted too, or only bytes
+    bool tracking = false;
+    const Instruction* at = nullptr;  // the instruction being executed
+    // (when the program at is in is about to go away)
+    void leave() {
+        at = nullptr;
+        sited = false;
+    }
+
+    // the Heap allocations on this thread go to, if any
+    static thread_local Heap* current;
+
+    // used by operator new and delete of tArray, tBlock and tDict
+    static void* allocate(size_t n, Kind kind) {
+        void* p = ::operator new(n);
+        if (current && current->tracking) current->add(p, kind);
+        return p;
+    }
+    static void deallocate(void* p) {
+        if (current && current->tracking) current->remove(p);
+        ::operator delete(p);
+    }
+
+    // used by the global operator new and delete, where they're replaced to
+    //   count bytes (see alloc.cpp); everywhere else, nothing calls these
+    static const bool countsBytes;
+    void allocated(size_t n) {
+        bytes.add(n);
+        if (tracking) site()->second.bytes += n;
+    }
+    void freed(size_t n) { bytes.add(-(long long)n); }
+
+    private:
+    void add(const void* p, Kind kind);
+    void remove(const void* p);
+    // (the one for at, which is looked up again only when at changes)
+    std::map<std::string, Site>::iterator site();
+    const Instruction* siteAt = nullptr;
+    std::map<std::string, Site>::iterator siteOf;
+    bool sited = false;
+};
+
 struct Variable {
     // constructors
     Variable(): undefinedVal(true) { type = UNDEFINED; }
     Variable(tUndefined x): undefinedVal(x) { type = UNDEFINED; }
     Variable(tNum x): numVal(x) { type = NUM; }
+    Variable(tNum x, int low): numLow(low), numVal(x) { type = NUM; }
     Variable(tArray* x): arrayVal(x) { type = ARRAY; }
     Variable(tBlock* x): blockVal(x) { type = BLOCK; }
+    Variable(tDict* x): dictVal(x) { type = DICT; }
 
     // destructor
     ~Variable() {}
@@ -37,36 +129,33 @@ struct Variable {
     // copy constructor
     Variable(const Variable& v) {
         type = v.type;
+        numLow = v.numLow;
         switch (v.type) {
         case UNDEFINED: undefinedVal = false; break;
         case NUM: numVal = v.numVal; break;
         case ARRAY: arrayVal = v.arrayVal; break;
         case BLOCK: blockVal = v.blockVal; break;
+        case DICT: dictVal = v.dictVal; break;
         }
     }
 
     // hacky function, basically same as copy ctor but creates new array/block
     //   pointers
-    Variable copy() {
-        Variable v;
-        v.type = type;
-        switch (type) {
-        case UNDEFINED: v.undefinedVal = undefinedVal; break;
-        case NUM: v.numVal = numVal; break;
-        case ARRAY: v.arrayVal = new tArray(*arrayVal); break;
-        case BLOCK: v.blockVal = new tBlock(*blockVal); break;
-        }
-        return v;
-    }
+    Variable copy();
+
+    // same as copy ctor, but the array/block gets another reference (so it is
+    //   shared copy-on-write instead of copied)
+    Variable share() const;
 
     // operators
     bool operator==(const Variable& v) const {
         if (type != v.type) return false;
         switch (v.type) {
         case UNDEFINED: return true;
-        case NUM: return numVal == v.numVal;
+        case NUM: return numVal == v.numVal && numLow == v.numLow;
         case ARRAY: return arrayVal == v.arrayVal;
         case BLOCK: return blockVal == v.blockVal;
+        case DICT: return dictVal == v.dictVal;
         default: throw SnowmanException("at Variable::operator==: impossible "
                     "type?", true);
         }
@@ -75,82 +164,964 @@ struct Variable {
         if (type != v.type) return type < v.type;
         switch (v.type) {
         case UNDEFINED: return false;
-        case NUM: return numVal < v.numVal;
+        case NUM: return numVal < v.numVal ||
+                      (numVal == v.numVal && numLow < v.numLow);
         case ARRAY: return arrayVal < v.arrayVal;
         case BLOCK: return blockVal < v.blockVal;
+        case DICT: return dictVal < v.dictVal;
         default: throw SnowmanException("at Variable::operator<: impossible "
                      "type?", true);
         }
     }
 
+    // agrees with operator== (so nested arrays and blocks hash by identity,
+    //   not by their contents)
+    size_t hash() const;
+
     // manage memory (use when modifying value)
     // BE VERY CAREFUL when calling this function
-    void mm() {
-        switch (type) {
-        case ARRAY: delete arrayVal; break;
-        case BLOCK: delete blockVal; break;
-        default: break;
-        }
-    }
+    // (this drops a reference; the array/block is only deleted once nothing
+    //   shares it anymore)
+    void mm();
 
     // the actual data
-    enum { UNDEFINED, NUM, ARRAY, BLOCK } type;
+    enum { UNDEFINED, NUM, ARRAY, BLOCK, DICT } type;
+    // (NUM only: what numVal is off from the exact integer by, see below;
+    //   it fits in what would otherwise be padding)
+    int numLow = 0;
     union {
         tUndefined undefinedVal;
         tNum numVal;
         tArray* arrayVal;
         tBlock* blockVal;
+        tDict* dictVal;
     };
 };
 
-// used for subroutines
+// numbers are doubles, which hold every integer up to 2^53 exactly. past
+//   that, an integer that still fits in 64 bits is kept exactly too: numVal
+//   is the nearest double, and numLow what that is off by (so the number is
+//   numVal + numLow; numLow is 0 for everything else). the operators that
+//   are exact on integers (addition, subtraction, multiplication, modulo,
+//   increment, decrement, absolute value, rounding, comparisons and the
+//   bitwise ones) use it; anything else just sees the nearest double, and a
+//   result that doesn't fit in 64 bits is a double again. (these are shared
+//   by everything that evaluates number operators: evalToken, infer.cpp,
+//   super.cpp, reduce.cpp, jit.cpp)
+
+const tNum EXACT_LIMIT = 9007199254740992.0; // 2^53
+const tNum INT_LIMIT = 9223372036854775808.0; // 2^63
+
+// the exact integer a number (x and its numLow) is, if it fits in 64 bits
+inline bool exactInt(tNum x, int low, long long& n) {
+    if (!(fabs(x) <= INT_LIMIT) || x != trunc(x)) return false;
+    // (2^63 itself doesn't fit, but it's the nearest double to the largest
+    //   integers that do)
+    if (x == INT_LIMIT) {
+        if (low >= 0) return false;
+        n = 9223372036854775807LL + (low + 1);
+        return true;
+    }
+    return !__builtin_add_overflow((long long)x, (long long)low, &n);
+}
+
+// the number for a 64-bit integer
+inline Variable exactNum(long long n) {
+    tNum x = (tNum)n;
+    return Variable(x, x == INT_LIMIT ? (int)(n - 9223372036854775807LL) - 1 :
+        (int)(n - (long long)x));
+}
+
+// rounded to a 64-bit integer, for the bitwise operators (anything out of
+//   range wraps around modulo 2^64, as it would in a 64-bit register, and
+//   NaN or infinity is 0)
+inline long long toInt(tNum x, int low = 0) {
+    long long n;
+    if (exactInt(x, low, n)) return n;
+    x = round(x);
+    if (fabs(x) < INT_LIMIT) return (long long)x;
+    if (!std::isfinite(x)) return 0;
+    // (a double this large is an integer, so fmod is exact)
+    unsigned long long u =
+        (unsigned long long)fmod(fabs(x), 18446744073709551616.0);
+    if (x < 0) u = 0 - u;
+    return (long long)(u + (unsigned long long)(long long)low);
+}
+
+// (as doubles; see arith for the exact result)
+inline tNum modulo(tNum a, tNum b) {
+    if (a == trunc(a) && b == trunc(b) && b != 0 &&
+            fabs(a) < EXACT_LIMIT && fabs(b) < EXACT_LIMIT) {
+        // (same as fmod, including the sign of a zero result)
+        tNum m = (tNum)((long long)a % (long long)b);
+        return m == 0 ? copysign(0.0, a) : m;
+    }
+    return fmod(a, b);
+}
+
+// the result of op ('+', '-', '*' or '%', for modulo) on two numbers, given
+//   the result r it has as doubles. that is already exact unless one of the
+//   numbers or the result is past 2^53 (see snowman.cpp for the rest)
+Variable exactArith(char op, tNum a, int aLow, tNum b, int bLow, tNum r);
+inline Variable arith(char op, tNum a, int aLow, tNum b, int bLow, tNum r) {
+    if (!(aLow | bLow) && fabs(r) < EXACT_LIMIT) return Variable(r);
+    return exactArith(op, a, aLow, b, bLow, r);
+}
+
+// a < b, exactly
+inline bool numLess(tNum a, int aLow, tNum b, int bLow) {
+    return a < b || (a == b && aLow < bLow);
+}
+
+// hashes, for eq and the operators that keep sets of values (ad, aor, aan)
+inline size_t hashBits(unsigned long long x) {
+    // (the finalizer of MurmurHash3, so that nearby numbers spread out)
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (size_t)x;
+}
+
+inline size_t hashNum(tNum x) {
+    // (0 and -0 are equal, so they need the same hash)
+    if (x == 0) x = 0;
+    unsigned long long bits;
+    memcpy(&bits, &x, sizeof bits);
+    return hashBits(bits);
+}
+
+inline size_t Variable::hash() const {
+    switch (type) {
+    case NUM: return hashNum(numVal) + numLow;
+    case ARRAY: return hashBits((unsigned long long)(size_t)arrayVal);
+    case BLOCK: return hashBits((unsigned long long)(size_t)blockVal);
+    case DICT: return hashBits((unsigned long long)(size_t)dictVal);
+    default: return 0;
+    }
+}
+
+// for std::unordered_set/map of Variables
+struct VariableHash {
+    size_t operator()(const Variable& v) const { return v.hash(); }
+};
+
+// equality the way eq sees it, which goes one level further than ==: arrays
+//   and blocks are equal if their contents are (the elements of arrays are
+//   still compared with ==), and dictionaries if they have equal keys with
+//   equal values. equalHash agrees with it (see snowman.cpp)
+bool equal(const Variable& a, const Variable& b);
+size_t equalHash(const Variable& v);
+
+// arrays and blocks are reference counted, so that they can be shared (ex.
+//   between a permavar and a variable) instead of copied. something that is
+//   shared (refs > 1) must not be modified in place
+//
+// an array can also be lazy (from nr and ar): then the vector is empty and the
+//   elements are only generated when something needs the vector itself (see
+//   materialize, which retrieve calls unless asked not to). operators that
+//   just go through the elements in order use length() and element() instead,
+//   so the array never has to be allocated
+//
+// arrays of numbers (strings, results of am, ...) are usually DENSE: the
+//   elements are kept as plain doubles in nums, and the vector is empty just
+//   like for a lazy array. the first time anything needs the vector (ex. to
+//   store something that isn't a number), materialize turns it into a normal
+//   array. some operators (ac, ar, aso, az, aa, aal, aag, af) work on nums
+//   directly instead
+//
+// slices (from aal, aag, an, asp) are lazy too: a SLICE only points into
+//   another array (which it keeps alive), so cutting an array in half doesn't
+//   copy anything until one of the halves is modified
+//
+// the hash of the elements is cached (eq checks it before comparing the
+//   elements themselves), so anything that changes an array in place has to
+//   call changed() afterwards
+struct tArray: public std::vector<Variable> {
+    using std::vector<Variable>::vector;
+    tArray() {}
+    tArray(const tArray& a): std::vector<Variable>(a) { lazyCopy(a); }
+    tArray& operator=(const tArray& a) {
+        if (source) source->release();
+        std::vector<Variable>::operator=(a);
+        lazyCopy(a);
+        return *this;
+    }
+    ~tArray();
+
+    void release() { if (--refs == 0) delete this; }
+    int refs = 1;
+
+    static void* operator new(size_t n) {
+        return Heap::allocate(n, Heap::ARRAY);
+    }
+    static void operator delete(void* p) { Heap::deallocate(p); }
+    // (roughly, what it takes up)
+    size_t bytes() const {
+        return sizeof *this + capacity() * sizeof(Variable) +
+            nums.capacity() * sizeof(tNum);
+    }
+
+    enum { EAGER, RANGE, REPEAT, DENSE, SLICE } form = EAGER;
+    size_type count = 0;        // RANGE, REPEAT, SLICE: number of elements
+    tNum from = 0;              // RANGE: first element (always an integer)
+    bool reverse = false;       // RANGE: counts down instead of up
+    tArray* source = nullptr;   // REPEAT, SLICE: the array repeated/sliced
+    size_type offset = 0;       // SLICE: index in source of the first element
+    long stride = 1;            // SLICE: step between elements in source
+    std::vector<tNum> nums;     // DENSE: the elements
+
+    size_type length() const {
+        return form == EAGER ? size() : form == DENSE ? nums.size() : count;
+    }
+    Variable element(size_type i) const;
+    void materialize();
+
+    // adds an element to the end (a DENSE array stays dense as long as only
+    //   numbers that are doubles, with no numLow, are added)
+    void append(const Variable& v);
+
+    // whether every element is a number (that a double holds exactly), and
+    //   if so, appends them all to out
+    bool numbers() const;
+    void appendNums(std::vector<tNum>& out) const;
+
+    // turns the array into a DENSE one, if every element is a number
+    bool densify();
+
+    // a new array of count elements of this one, starting at offset and
+    //   stride apart (a SLICE of this array, unless it's short enough that
+    //   copying is cheaper)
+    tArray* slice(size_type offset, size_type count, long stride);
+
+    // a new array with the elements of this one, except that nested arrays
+    //   (up to the given number of layers down, or all of them for 0) are
+    //   replaced by their elements (see snowman.cpp)
+    tArray* flatten(int layers) const;
+
+    // hash of the elements (the same for every form of an array, so a lazy
+    //   array doesn't have to be materialized for it)
+    size_t hash() const;
+    void changed() { hashed = false; }
+
+    private:
+    mutable size_t cachedHash = 0;
+    mutable bool hashed = false;
+
+    void lazyCopy(const tArray& a) {
+        form = a.form;
+        count = a.count;
+        from = a.from;
+        reverse = a.reverse;
+        offset = a.offset;
+        stride = a.stride;
+        source = a.source;
+        if (source) ++source->refs;
+        nums = a.nums;
+        cachedHash = a.cachedHash;
+        hashed = a.hashed;
+    }
+};
+
+// a place in the code given to Snowman::run (both start at 1; a line of 0
+//   is unknown)
+struct Location {
+    unsigned line, column;
+};
+
+// where each stretch of some code came from, as the offset in that code where
+//   it starts and its location (the offsets after it, up to the next one,
+//   are the columns after it on the same line); see locate
+typedef std::vector<std::pair<std::string::size_type, Location>> SourceMap;
+Location locate(const SourceMap& map, std::string::size_type offset);
+// the SourceMap of code given to run (a stretch for every line)
+SourceMap sourceLines(const std::string& code);
+
+struct tBlock: public std::string {
+    using std::string::basic_string;
+    tBlock() {}
+    tBlock(const std::string& s): std::string(s) {}
+    tBlock(const tBlock& b): std::string(b),
+        source(b.source ? new SourceMap(*b.source) : nullptr) {}
+    ~tBlock();
+
+    void release() { if (--refs == 0) delete this; }
+    int refs = 1;
+
+    static void* operator new(size_t n) {
+        return Heap::allocate(n, Heap::BLOCK);
+    }
+    static void operator delete(void* p) { Heap::deallocate(p); }
+    size_t bytes() const { return sizeof *this + capacity(); }
+
+    // compiled on first run, so that loops don't re-tokenize the block every
+    //   iteration
+    Program* program = nullptr;
+
+    // where the block's code came from, if it was a literal compiled for the
+    //   sampling profiler (see Snowman::compile)
+    SourceMap* source = nullptr;
+
+    // (blocks are never modified in place, so this is computed only once)
+    size_t hash() const {
+        if (!hashed) {
+            cachedHash = std::hash<std::string>()(*this);
+            hashed = true;
+        }
+        return cachedHash;
+    }
+
+    private:
+    mutable size_t cachedHash = 0;
+    mutable bool hashed = false;
+};
+
+typedef tArray::size_type vvs;
+typedef tBlock::size_type ss;
+
+// dictionaries (from vd) map keys to values, where keys match if they're
+//   equal (see equal above), so array-"strings" work as keys. the entries are
+//   kept in one flat vector in the order they were added, and found through
+//   an open addressing table (linear probing) of indices into it. deleting an
+//   entry leaves a hole in the vector until the table is next rebuilt, but
+//   nothing in the table, so lookups never have to skip over deleted entries
+//
+// like arrays, dictionaries are shared copy-on-write, and don't release
+//   their keys and values (see dict.cpp)
+struct tDict {
+    tDict() {}
+    tDict(const tDict& d): entries(d.entries), table(d.table), live(d.live) {}
+
+    void release() { if (--refs == 0) delete this; }
+    int refs = 1;
+
+    static void* operator new(size_t n) {
+        return Heap::allocate(n, Heap::DICT);
+    }
+    static void operator delete(void* p) { Heap::deallocate(p); }
+    size_t bytes() const {
+        return sizeof *this + entries.capacity() * sizeof(Entry) +
+            table.capacity() * sizeof(unsigned);
+    }
+
+    struct Entry {
+        Variable key, value;  // (key is undefined for a hole)
+        size_t hash;
+    };
+    std::vector<Entry> entries;
+
+    vvs size() const { return live; }
+    // the value for a key, or nullptr if there's no such key
+    const Variable* get(const Variable& key) const;
+    // (replaces the value if the key is already there)
+    void set(const Variable& key, const Variable& value);
+    // returns false if there was no such key
+    bool erase(const Variable& key);
+
+    private:
+    std::vector<unsigned> table;  // index in entries + 1, or 0 if empty
+    vvs live = 0;                 // entries that aren't holes
+
+    // the slot in the table that holds the key, or the empty one where it
+    //   would go
+    size_t find(const Variable& key, size_t hash) const;
+    void rebuild(size_t capacity);
+};
+
+inline Variable Variable::copy() {
+    Variable v;
+    v.type = type;
+    switch (type) {
+    case UNDEFINED: v.undefinedVal = undefinedVal; break;
+    case NUM: v.numVal = numVal; v.numLow = numLow; break;
+    case ARRAY: v.arrayVal = new tArray(*arrayVal); break;
+    case BLOCK: v.blockVal = new tBlock(*blockVal); break;
+    case DICT: v.dictVal = new tDict(*dictVal); break;
+    }
+    return v;
+}
+
+inline Variable Variable::share() const {
+    switch (type) {
+    case ARRAY: ++arrayVal->refs; break;
+    case BLOCK: ++blockVal->refs; break;
+    case DICT: ++dictVal->refs; break;
+    default: break;
+    }
+    return *this;
+}
+
+inline void Variable::mm() {
+    switch (type) {
+    case ARRAY: arrayVal->release(); break;
+    case BLOCK: blockVal->release(); break;
+    case DICT: dictVal->release(); break;
+    default: break;
+    }
+}
+
+// a new array (or block, or dictionary) that an operator is building, which
+//   is let go of if the operator stops before it's stored (ex. because a
+//   block it runs goes over a limit)
+template<typename T> class Owned {
+    public:
+    explicit Owned(T* p): p(p) {}
+    Owned(const Owned&) = delete;
+    Owned& operator=(const Owned&) = delete;
+    ~Owned() { if (p) p->release(); }
+    T* operator->() const { return p; }
+    T& operator*() const { return *p; }
+    T* get() const { return p; }
+    // (for storing it; from then on it's the variable's)
+    T* take() { T* q = p; p = nullptr; return q; }
+    void reset(T* q) { if (p) p->release(); p = q; }
+    private:
+    T* p;
+};
+
+inline tArray::~tArray() { if (source) source->release(); }
+
+inline Variable tArray::element(vvs i) const {
+    switch (form) {
+    case RANGE: return Variable(from + (reverse ? -(tNum)i : (tNum)i));
+    case REPEAT: return source->element(i % source->length());
+    case SLICE: return source->element(offset + stride * (long)i);
+    case DENSE: return Variable(nums[i]);
+    default: return (*this)[i];
+    }
+}
+
+inline size_t tArray::hash() const {
+    if (!hashed) {
+        vvs n = length();
+        size_t h = hashBits(n);
+        if (form == DENSE) {
+            for (tNum x : nums) h = h * 31 + hashNum(x);
+        } else {
+            for (vvs i = 0; i < n; ++i) h = h * 31 + element(i).hash();
+        }
+        cachedHash = h;
+        hashed = true;
+    }
+    return cachedHash;
+}
+
+inline void tArray::materialize() {
+    if (form == EAGER) return;
+    vvs n = length();
+    reserve(n);
+    for (vvs i = 0; i < n; ++i) push_back(element(i));
+    if (source) source->release();
+    source = nullptr;
+    std::vector<tNum>().swap(nums);
+    form = EAGER;
+}
+
+inline void tArray::append(const Variable& v) {
+    if (form == DENSE && v.type == Variable::NUM && !v.numLow) {
+        nums.push_back(v.numVal);
+    } else {
+        materialize();
+        push_back(v);
+    }
+}
+
+inline bool tArray::numbers() const {
+    switch (form) {
+    case RANGE: case DENSE: return true;
+    case REPEAT: case SLICE: return source->numbers();
+    default:
+        for (const Variable& v : *this) {
+            if (v.type != Variable::NUM || v.numLow) return false;
+        }
+        return true;
+    }
+}
+
+inline void tArray::appendNums(std::vector<tNum>& out) const {
+    switch (form) {
+    case DENSE:
+        out.insert(out.end(), nums.begin(), nums.end());
+        break;
+    case REPEAT: {
+        // (one copy of the source, then the rest is copied from that)
+        vvs start = out.size(), period = source->length();
+        if (count == 0) break;
+        source->appendNums(out);
+        out.resize(start + count);
+        for (vvs i = period; i < count; i += period) {
+            std::copy(out.begin() + start, out.begin() + start +
+                std::min(period, count - i), out.begin() + start + i);
+        }
+        break;
+    }
+    case SLICE:
+        if (source->form == DENSE && stride == 1) {
+            out.insert(out.end(), source->nums.begin() + offset,
+                source->nums.begin() + offset + count);
+            break;
+        }
+        // fall through
+    default:
+        out.reserve(out.size() + length());
+        for (vvs i = 0; i < length(); ++i) out.push_back(element(i).numVal);
+        break;
+    }
+}
+
+inline bool tArray::densify() {
+    if (form == DENSE) return true;
+    if (!numbers()) return false;
+    std::vector<tNum> out;
+    appendNums(out);
+    std::vector<Variable>().swap(*this);
+    if (source) source->release();
+    source = nullptr;
+    nums.swap(out);
+    form = DENSE;
+    return true;
+}
+
+inline tArray* tArray::slice(vvs offset, vvs count, long stride) {
+    auto arr = new tArray;
+    if (count < 32) {
+        arr->form = DENSE;
+        for (vvs i = 0; i < count; ++i) {
+            arr->append(element(offset + stride * (long)i));
+        }
+        return arr;
+    }
+    // (slices of slices point straight into the original array)
+    tArray* parent = this;
+    if (form == SLICE) {
+        offset = this->offset + this->stride * (long)offset;
+        stride *= this->stride;
+        parent = source;
+    }
+    arr->form = SLICE;
+    arr->count = count;
+    arr->offset = offset;
+    arr->stride = stride;
+    arr->source = parent;
+    ++parent->refs;
+    return arr;
+}
+
+// a token, decoded ahead of time (see Snowman::decode)
+struct Instruction {
+    enum { OPERATOR, NUMBER, STRING, BLOCK, PERMAVAR, SUB_START, SUB_END,
+        INVALID } type;
+    std::string token;  // as it appeared in the code (for debug output)
+    long op;            // OPERATOR: see HSH1/HSH2/HSH3 in snowman.cpp
+    bool consume;       // OPERATOR: capitalization of letter operators
+    tNum num;           // NUMBER (and what it's off by, past 2^53: see
+    int numLow;         //   exactNum)
+    int permavar;       // PERMAVAR
+    std::string str;    // STRING and BLOCK: contents of the literal
+    Variable literal;   // STRING and BLOCK: its value, from a constant pool
+                        //   (see Snowman::intern)
+    std::string error;  // if nonempty, thrown when executed (after storing the
+    bool fatal;         //   number, for NUMBER)
+    int super;          // if nonzero, executed together with the next
+    vvs span;           //   span - 1 instructions (see super.cpp)
+    bool typed;         // if true, the arguments are known to be numbers in
+    signed char args[2];//   args (-1 if there's only one), and the result
+    signed char dest;   //   goes in dest (-1 if nowhere; see infer.cpp)
+    std::vector<bool> fusable;  // the first of a pipeline: whether it can be
+                                //   fused, by state (see Snowman::fusability)
+};
+
+// a block translated to C++ ahead of time (see emit.cpp); returns false if it
+//   stopped because of a fatal error
+typedef bool (*TranslatedBlock)(Snowman&);
+
+// a compiled string of code
+struct Program {
+    Program(): translated(nullptr), permavarCount(0), runs(0),
+        native(nullptr), nativeSize(0), nativeFailed(false), typed(false) {}
+    ~Program();
+
+    std::vector<Instruction> instructions;
+    TranslatedBlock translated; // used instead of instructions if set
+
+    // where each instruction came from, for the sampling profiler (empty if
+    //   it isn't on, or nothing is known about where the code came from)
+    std::vector<Location> locations;
+
+    // values of the string and block literals, by token
+    std::map<std::string, Variable> constants;
+
+    // the size the permavar table needs to be (see Snowman::tokenize)
+    vvs permavarCount;
+
+    // for the JIT (see jit.cpp)
+    unsigned long runs;
+    void* native;
+    vvs nativeSize;
+    bool nativeFailed;
+
+    // for typed instructions (see infer.cpp): whether there are any, and the
+    //   active variables, their types and the current permavar's type they
+    //   were inferred for
+    bool typed;
+    bool typedActive[8];
+    int typedTypes[8];
+    int typedPermavar;
+
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+};
+
+// code compiled ahead of time, to be run over and over (see batch.cpp): its
+//   program, and the program of every block literal in it, by the block's
+//   code. a Script isn't changed once it's made, so Snowmen on different
+//   threads can share one; each copies a program the first time it runs it,
+//   with its own values for the literals (since those are counted)
+struct Script {
+    Script(std::string code);
+    ~Script();
+
+    Program* main;  // (null if the code couldn't be compiled)
+    std::map<std::string, Program*> blocks;
+    const Program* block(const std::string& code) const {
+        auto b = blocks.find(code);
+        return b == blocks.end() ? nullptr : b->second;
+    }
+
+    Script(const Script&) = delete;
+    Script& operator=(const Script&) = delete;
+
+    private:
+    void addBlocks(Snowman& sm, const Program& prog);
+};
+
+// a job for Snowman::batch: a script to run, the file its input comes from and
+//   the one its output goes to
+struct BatchJob {
+    const Script* script;
+    std::string input, output;
+
+    // (set by batch) how long the whole job took, and anything it printed to
+    //   stderr, or why it couldn't run
+    double milliseconds;
+    std::string errors;
+};
+
+inline tBlock::~tBlock() {
+    delete program;
+    delete source;
+}
+
+// used for subroutines (one frame per level of `((' nesting)
 struct VarState {
     Variable vars[8];
-    bool activeVars[8];
+    bool activeVars[8] = {false};
+};
+
+// the random number generator behind vr, nra and ash (xoshiro256**). every
+//   Snowman has its own, so nothing is shared between instances, and a seed
+//   makes a run reproducible
+struct Random {
+    unsigned long long s[4];
+
+    void seed(unsigned long long x) {
+        // (the state is filled with splitmix64, so that any seed, even 0,
+        //   gives a good one)
+        for (auto& w : s) {
+            unsigned long long z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            w = z ^ (z >> 31);
+        }
+    }
+
+    unsigned long long next() {
+        unsigned long long result = rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // in [0, 1), with all 53 bits of a double random
+    tNum real() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    // in [0, n), without bias and (usually) without dividing: the high half
+    //   of a 32x32-bit product is uniform unless the low half lands in the
+    //   first 2^32 mod n values, which are redrawn (Lemire's method)
+    unsigned long long below(unsigned long long n) {
+        if (n > 0xffffffffULL) return next() % n;  // (bias of at most 2^-32)
+        unsigned long long m = (next() >> 32) * n;
+        if ((unsigned)m < n) {
+            unsigned threshold = (unsigned)(-(unsigned)n) % (unsigned)n;
+            while ((unsigned)m < threshold) m = (next() >> 32) * n;
+        }
+        return m >> 32;
+    }
+
+    // Fisher-Yates
+    template<typename T> void shuffle(T* first, T* last) {
+        for (unsigned long long i = last - first; i > 1; --i) {
+            std::swap(first[i - 1], first[below(i)]);
+        }
+    }
+
+    private:
+    static unsigned long long rotl(unsigned long long x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
 };
 
 class Snowman {
+    friend struct Script;
+
     private:
         // internal evaluation methods
-        void evalToken(std::string token);
+        static Instruction decode(std::string token);
+        static void intern(Instruction& ins,
+                std::map<std::string, Variable>& pool,
+                const std::string& key = "");
+        bool compile(std::string code, Program& prog,
+                const SourceMap* source = nullptr);
+        void instantiate(const Program& from, Program& to);
+        void runProgram(Program& prog);
+        const Script* script; // (the one being run, if any)
+        void execute(const Program& prog);
+        bool step(const Instruction& ins);
+        void evalToken(const Instruction& ins);
+        void run(tBlock* blk);
         void store(Variable v);
-        Variable retrieve(int type, bool consume = true, int skip = 0);
+        Variable retrieve(int type, bool consume = true, int skip = 0,
+                bool lazy = false);
 
         template<typename T = tUndefined, typename U = tUndefined,
             typename V = tUndefined, typename W = tUndefined> class Retrieval{};
 
         // utility methods having to do with the language itself
-        static std::string arrToString(tArray arr);
+        static std::string arrToString(const tArray& arr);
         static Variable stringToArr(std::string str);
         static std::string inspect(Variable str);
+        static void inspect(const Variable& v, std::string& out);
+        static void inspect(const Variable& v, std::string& out, vvs items,
+                int depth);
         static bool toBool(Variable v);
 
         // command line args
         tArray args;
 
         // variables and permavars
-        Variable vars[8];
-        bool activeVars[8];
-        std::vector<VarState> subroutines;
-        std::map<int, Variable> permavars;
+        // vars and activeVars point into the current subroutine frame
+        std::vector<VarState> frames;
+        vvs depth, peakDepth;
+        Variable* vars;
+        bool* activeVars;
+        std::vector<Variable> permavars; // indexed by activePermavar
         int activePermavar;
+        // which permavars `*' or `#' has been used on (debug shows only
+        //   those, even if they're still undefined)
+        std::vector<bool> permavarsUsed;
+        void usePermavar() {
+            if ((vvs)activePermavar >= permavarsUsed.size()) {
+                permavarsUsed.resize(activePermavar + 1);
+            }
+            permavarsUsed[activePermavar] = true;
+        }
         bool savedActiveState[8];
 
+        // what debug last showed in each slot (the 8 variables, then the
+        //   permavars), for debugElide
+        struct Shown {
+            const void* value;  // (the array, block or dictionary)
+            vvs length;
+            size_t hash;
+        };
+        std::vector<Shown> shown;
+        bool unchanged(const Variable& v, Shown& last);
+        std::string debugBuffer;
+
+        Random random;
+
+        // checked every time a block starts running (which includes every
+        //   iteration of every loop), so it's kept down to an addition and a
+        //   comparison; the clock and the memory use are only looked at every
+        //   so often (see checkLimits)
+        void safepoint(vvs instructions) {
+            if (limited && ((executed += instructions) > budget ||
+                    (++safepoints & 63) == 0 || limitHit)) {
+                checkLimits();
+            }
+        }
+        void checkLimits();
+        bool limited, limitHit;
+        unsigned long long executed, budget, safepoints;
+        std::chrono::steady_clock::time_point started;
+        // the heap's live bytes when the run started (the limit is on how
+        //   much more than that it holds on to)
+        long long memoryBase;
+
+        // sampling profiler (see profile.cpp): every block being executed has
+        //   a frame on profileStack, through which a sample finds the
+        //   instruction each one is at. the timer's signal only counts
+        //   samplesDue, and execute takes them between instructions
+        struct ProfileFrame {
+            const Program* prog;
+            const vvs* at;
+        };
+        std::vector<ProfileFrame> profileStack;
+        static volatile sig_atomic_t samplesDue;
+        static void onSample(int);
+        void sample();
+        void startSampling();
+        void stopSampling();
+        struct HotSpot {
+            unsigned long self, total;
+            std::string token;
+        };
+        std::map<std::pair<unsigned, unsigned>, HotSpot> hotSpots;
+        std::map<std::string, unsigned long> stacks; // (folded, see below)
+        unsigned long samples;
+
+        Heap heap;
+
+        // superinstructions (see super.cpp)
+        static void fuse(Program& prog);
+        bool stepSuper(const Instruction* ins);
+        bool stepPipeline(const Instruction* ins);
+        static bool numeric(const std::vector<Instruction>& code,
+                bool* defined, const bool* active, int permavar);
+        static void fusability(Instruction* ins);
+
+        // instructions run without retrieve/store (see infer.cpp)
+        void infer(Program& prog);
+        bool typedEntry(const Program& prog);
+        void stepTyped(const Instruction& ins);
+
+        // folds done without running the block (see reduce.cpp)
+        static bool reduce(const tArray& arr, const std::string& code,
+                Variable& result);
+
+        // native code for hot blocks (see jit.cpp)
+        bool jitCompile(Program& prog);
+        bool runNative(Program& prog);
+        static int jitCall(Snowman* sm, const Instruction* ins);
+
+        // C++ translation (see emit.cpp)
+        std::map<std::string, TranslatedBlock> translatedBlocks;
+        std::map<std::string, Variable> constants; // (for instruction)
+        static vvs emitFunction(std::string code,
+                std::vector<std::string>& tokens,
+                std::vector<std::string>& functions,
+                std::map<std::string, vvs>& blocks);
+
     public:
         // constructor / destructor
         Snowman();
         ~Snowman();
 
         // for manipulating a string of code
-        static std::vector<std::string> tokenize(std::string code);
+        static std::vector<std::string> tokenize(std::string code,
+                vvs* permavarCount = nullptr,
+                std::vector<std::pair<vvs, vvs>>* starts = nullptr);
         void run(std::string code);
+        void run(const Script& script);
+
+        // where input is read from and output is written to (stdin, stdout
+        //   and stderr unless they're changed)
+        std::istream* in;
+        std::ostream* out;
+        std::ostream* err;
+
+        // run every job on a pool of the given number of threads, each in a
+        //   Snowman of its own with the same options as settings (and
+        //   arguments, and a seed from its random number generator). the
+        //   output of a job is written once it's done
+        static void batch(std::vector<BatchJob>& jobs, unsigned threads,
+                const Snowman& settings);
 
         // command line args
         void addArg(std::string arg);
 
+        // start the random number generator from a given seed (otherwise
+        //   it's seeded from the time)
+        void seed(unsigned long long s);
+
+        // maximum nesting of subroutines (the frames are preallocated)
+        void setMaxDepth(vvs maxDepth);
+        const static vvs DEFAULT_MAX_DEPTH = 1024;
+
         // debugging (also used for REPL)
         std::string debug();
+        void debug(std::string& out);
         bool debugOutput;
+        // how much of each value debug shows: at most debugItems elements at
+        //   the start and at the end of every array and dictionary, and
+        //   debugDepth levels of them (0 is no limit for either). with
+        //   debugElide, a slot whose value hasn't changed since the previous
+        //   dump is shown as (same)
+        vvs debugItems, debugDepth;
+        bool debugElide;
+
+        // limits on every run (0 is no limit): how many instructions it can
+        //   execute (counted a block at a time, when the block starts), how
+        //   many milliseconds it can take, and how many megabytes the run
+        //   can have allocated and not freed yet (counted by heap, on this
+        //   Snowman's thread only; no limit unless Heap::countsBytes). a run
+        //   that goes over one is stopped with a SnowmanLimitException, and
+        //   with limitDump, the variables are printed to stderr (as debug()
+        //   shows them)
+        unsigned long long instructionLimit;
+        unsigned long timeLimit, memoryLimit;
+        bool limitDump;
+
+        // sample every run every SAMPLE_INTERVAL microseconds of CPU time
+        //   (Linux only; the JIT is off meanwhile, since native code doesn't
+        //   run instructions one by one)
+        bool sampleProfile;
+        const static unsigned SAMPLE_INTERVAL = 1000;
+        // what the samples found: the places (line:column) that took the
+        //   most of them, both themselves and through the blocks they ran,
+        //   and every stack of places that was sampled, one per line in the
+        //   "folded" format flame graph tools read
+        std::string profileHotSpots();
+        std::string profileStacks();
+
+        // keep track of allocations (see Heap) from the next run on, which
+        //   memoryReport sums up: how many arrays, blocks and dictionaries
+        //   there are and were at most, the bytes allocated, what each
+        //   operator allocated, and what's left over that can't be reached
+        //   from the variables, permavars or arguments anymore (by operator,
+        //   as unreachable returns it)
+        bool memStats;
+        const Heap& memory() const { return heap; }
+        std::map<std::string, Heap::Site> unreachable();
+        std::string memoryReport();
+
+        // compile blocks to native code once they have run this many times
+        //   (0 disables the JIT; only available on x86-64 Linux)
+        unsigned long jitThreshold;
+
+        // translate code into a C++ program that runs it without an
+        //   interpreter loop (see emit.cpp)
+        static std::string emitCpp(std::string code);
+
+        // how often each pair of instructions that could be fused into a
+        //   superinstruction appears in code (see super.cpp)
+        static std::map<std::pair<std::string, std::string>, unsigned long>
+            countPairs(std::string code);
+
+        // errors that are certain to happen when code is run (see infer.cpp)
+        static std::vector<std::string> check(std::string code);
+
+        // used by the generated C++ code
+        Instruction instruction(std::string token);
+        bool exec(const Instruction& ins) { return step(ins); }
+        void addTranslatedBlock(std::string code, TranslatedBlock fn);
+        Variable* variables() { return vars; }
+        bool* active() { return activeVars; }
 
         // version
         const static int MAJOR_VERSION = 1;
@@ -0,0 +1,440 @@
+#include "snowman.hpp"
+#include <iostream>   // std::endl
+// included from snowman.hpp: <vector>, <string>, <map>, <cmath>
+
+#define HSH1(a) ((long)a)
+#define HSH2(a,b) (((long)a)*256 + ((long)b))
+#define HSH3(a,b,c) (((long)a)*256*256 + ((long)b)*256 + ((long)c))
+
+// superinstructions: runs of instructions that compile() marks to be executed
+// in one go (see Snowman::stepSuper). these are
+// - pairs of instructions that show up together often; the pairs that get
+//   fused are the ones listed in superinstructions.hpp, which is generated
+//   from a corpus of programs by tools/superinstructions.sh
+// - pipelines of array operators, like :...;aM :...;ASE :...;aF, which go
+//   through the source array once without building the arrays in between
+
+namespace {
+
+struct Superinstruction {
+    const char* first;
+    const char* second;
+    unsigned long count; // number of times the pair was seen in the corpus
+};
+
+const Superinstruction SUPERINSTRUCTIONS[] = {
+#include "superinstructions.hpp"
+};
+
+// what kind of superinstruction a pair is (Instruction::super)
+enum { NONE, NUM_BINARY, STR_PRINT, PIPELINE };
+
+bool binary(const Instruction& ins) {
+    if (ins.type != Instruction::OPERATOR) return false;
+    switch (ins.op) {
+    case HSH2('n','a'): case HSH2('n','s'): case HSH2('n','m'):
+    case HSH2('n','d'): case HSH3('N','M','O'): case HSH2('n','l'):
+    case HSH2('n','g'): case HSH2('e','q'):
+        return true;
+    default:
+        return false;
+    }
+}
+
+// (must match the operators in evalToken)
+Variable binaryResult(long op, tNum a, int aLow, tNum b, int bLow) {
+    switch (op) {
+    case HSH2('n','a'): return arith('+', a, aLow, b, bLow, a + b);
+    case HSH2('n','s'): return arith('-', a, aLow, b, bLow, a - b);
+    case HSH2('n','m'): return arith('*', a, aLow, b, bLow, a * b);
+    case HSH2('n','d'): return Variable(a / b);
+    case HSH3('N','M','O'): return arith('%', a, aLow, b, bLow, modulo(a, b));
+    case HSH2('n','l'): return Variable((tNum)numLess(a, aLow, b, bLow));
+    case HSH2('n','g'): return Variable((tNum)numLess(b, bLow, a, aLow));
+    default /* eq */: return Variable((tNum)(a == b && aLow == bLow));
+    }
+}
+
+int kind(const Instruction& a, const Instruction& b) {
+    if (a.type == Instruction::NUMBER && a.error.empty() && binary(b)) {
+        return NUM_BINARY;
+    }
+    if (a.type == Instruction::STRING && b.type == Instruction::OPERATOR &&
+            b.op == HSH2('s','p') && b.consume) {
+        return STR_PRINT;
+    }
+    return NONE;
+}
+
+// a stage of a pipeline: a block literal followed by a consuming aM or ASE
+// (or aF, which can only be the last stage)
+bool stage(const Instruction* ins, bool last) {
+    return ins[0].type == Instruction::BLOCK &&
+        ins[1].type == Instruction::OPERATOR && ins[1].consume &&
+        (ins[1].op == HSH2('a','m') || ins[1].op == HSH3('A','S','E') ||
+            (last && ins[1].op == HSH2('a','f')));
+}
+
+// the operators a pipeline stage's block may use: only ones that take and
+// return numbers (so, as long as their arguments are numbers, they can't
+// fail), and that don't touch anything other than the variables
+int arguments(long op, int& results) {
+    results = 1;
+    switch (op) {
+    case HSH2('v','n'):
+        results = 0;
+        return 0;
+    case HSH3('N','D','E'): case HSH3('N','I','N'): case HSH3('N','A','B'):
+    case HSH2('n','f'): case HSH2('n','c'): case HSH3('N','R','O'):
+    case HSH3('N','B','N'): case HSH2('n','o'):
+        return 1;
+    case HSH2('d','u'):
+        results = 2;
+        return 1;
+    case HSH3('N','B','O'): case HSH3('N','B','A'): case HSH3('N','B','X'):
+    case HSH2('n','a'): case HSH2('n','s'): case HSH2('n','m'):
+    case HSH2('n','d'): case HSH3('N','M','O'): case HSH2('n','l'):
+    case HSH2('n','g'): case HSH2('n','p'): case HSH2('e','q'):
+    case HSH2('b','o'): case HSH2('o','r'):
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+// see ROT2/ROT3 in snowman.cpp (c is -1 for ROT2)
+struct Rotation { long op; int a, b, c; };
+const Rotation ROTATIONS[] = {
+    {HSH1('/'), 2, 5, -1}, {HSH1('\\'), 0, 7, -1}, {HSH1('_'), 5, 7, -1},
+    {HSH1('['), 0, 5, -1}, {HSH1(']'), 2, 7, -1}, {HSH1('|'), 1, 6, -1},
+    {HSH1('-'), 3, 4, -1}, {HSH1('\''), 1, 3, -1}, {HSH1('`'), 1, 4, -1},
+    {HSH1(','), 4, 6, -1}, {HSH1('.'), 3, 6, -1}, {HSH1('^'), 1, 3, 4},
+    {HSH1('>'), 5, 4, 0}, {HSH1('<'), 2, 3, 7}
+};
+
+}
+
+// run a block "on paper": defined says which variables hold a number (all
+// others are undefined), active which are active, and permavar whether the
+// current permavar holds a number (-1 if it holds something that isn't one).
+// returns false if the block might do anything but shuffle numbers around
+bool Snowman::numeric(const std::vector<Instruction>& code, bool* defined,
+        const bool* active, int permavar) {
+    int act[8], n = 0;
+    for (int i = 0; i < 8; ++i) if (active[i]) act[n++] = i;
+    for (const Instruction& ins : code) {
+        int args = 0, results = 0;
+        if (ins.type == Instruction::NUMBER) {
+            if (!ins.error.empty()) return false;
+            results = 1;
+        } else if (ins.type != Instruction::OPERATOR) {
+            return false;
+        } else if (ins.op == HSH1('#')) {
+            if (permavar < 0) return false;
+            results = permavar;
+        } else if ((args = arguments(ins.op, results)) < 0) {
+            const Rotation* rot = nullptr;
+            for (const Rotation& r : ROTATIONS) if (r.op == ins.op) rot = &r;
+            // (inactive variables can hold anything, and have to be left
+            //   alone so every element sees the same ones)
+            if (!rot || !active[rot->a] || !active[rot->b] ||
+                    (rot->c != -1 && !active[rot->c])) return false;
+            bool t = defined[rot->a];
+            if (rot->c == -1) {
+                defined[rot->a] = defined[rot->b];
+                defined[rot->b] = t;
+            } else {
+                defined[rot->a] = defined[rot->b];
+                defined[rot->b] = defined[rot->c];
+                defined[rot->c] = t;
+            }
+            continue;
+        }
+        // (arguments are the first active variables, in order)
+        if (args > n) return false;
+        for (int i = 0; i < args; ++i) if (!defined[act[i]]) return false;
+        if (ins.consume) for (int i = 0; i < args; ++i) defined[act[i]] = false;
+        for (int r = 0; r < results; ++r) {
+            for (int i = 0; i < n; ++i) {
+                if (!defined[act[i]]) {
+                    defined[act[i]] = true;
+                    break;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// work out, for a pipeline, which states it can be fused in: a pipeline is
+// only fused if every stage's block is numeric (see above) and leaves exactly
+// its result behind, which only depends on the active variables (the source
+// array being in the first of them) and on what the current permavar holds.
+// so it's found out here, once, for every one of those, by
+//   fusable[(permavar + 1) * 256 + active variables as a bitmask]
+// and stepPipeline only has to look at the variables themselves
+void Snowman::fusability(Instruction* ins) {
+    vvs stages = ins[0].span / 2;
+    ins[0].fusable.assign(3 * 256, false);
+    std::vector<std::vector<Instruction>> code(stages);
+    for (vvs s = 0; s < stages; ++s) {
+        try {
+            for (const std::string& token : tokenize(ins[2*s].str)) {
+                code[s].push_back(decode(token));
+            }
+        } catch (SnowmanException& se) {
+            return;
+        }
+    }
+
+    for (int permavar = -1; permavar <= 1; ++permavar) {
+        for (int mask = 0; mask < 256; ++mask) {
+            bool active[8];
+            int act[8], n = 0;
+            for (int i = 0; i < 8; ++i) {
+                if ((active[i] = mask & (1 << i))) act[n++] = i;
+            }
+            bool fusable = n >= 2;
+            for (vvs s = 0; fusable && s < stages; ++s) {
+                const Instruction& op = ins[2*s + 1];
+                bool defined[8] = {false};
+                defined[act[0]] = true;
+                if (op.op == HSH2('a','f')) defined[act[1]] = true;
+                fusable = numeric(code[s], defined, active, permavar);
+                // aM takes the first active variable, ASE the first defined
+                // one, and aF keeps the result where the next element goes
+                // after it
+                int left = 0, first = -1;
+                for (int i = 0; i < n; ++i) {
+                    if (defined[act[i]]) {
+                        ++left;
+                        if (first == -1) first = i;
+                    }
+                }
+                if (op.op == HSH3('A','S','E')) fusable = fusable && left == 1;
+                else fusable = fusable && left == 1 && first == 0;
+            }
+            ins[0].fusable[(permavar + 1) * 256 + mask] = fusable;
+        }
+    }
+}
+
+namespace {
+
+// name an instruction the way superinstructions.hpp does (literals by their
+// type, operators by their lowercase/uppercase hashed form)
+std::string key(const Instruction& ins) {
+    if (ins.type == Instruction::NUMBER) return "<num>";
+    if (ins.type == Instruction::STRING) return "<str>";
+    std::string name;
+    for (long op = ins.op; op; op /= 256) name = (char)(op % 256) + name;
+    return name;
+}
+
+}
+
+// mark every pipeline, and every pair of instructions that is on the list, in
+// a compiled program
+void Snowman::fuse(Program& prog) {
+    std::vector<Instruction>& ins = prog.instructions;
+    for (vvs i = 0; i + 1 < ins.size(); ++i) {
+        vvs stages = 0;
+        while (i + 2*stages + 1 < ins.size() &&
+                stage(&ins[i + 2*stages], false)) ++stages;
+        if (i + 2*stages + 1 < ins.size() && stage(&ins[i + 2*stages], true)) {
+            ++stages;
+        }
+        if (stages >= 2) {
+            ins[i].super = PIPELINE;
+            ins[i].span = 2*stages;
+            fusability(&ins[i]);
+            i += 2*stages - 1;
+            continue;
+        }
+
+        int k = kind(ins[i], ins[i+1]);
+        if (k == NONE) continue;
+        std::string first = key(ins[i]), second = key(ins[i+1]);
+        for (const Superinstruction& s : SUPERINSTRUCTIONS) {
+            if (first == s.first && second == s.second) {
+                ins[i].super = k;
+                ins[i].span = 2;
+                ++i; // (superinstructions don't overlap)
+                break;
+            }
+        }
+    }
+}
+
+// execute a superinstruction (ins[0] up to ins[ins[0].span - 1])
+// the fast paths are only taken when none of the instructions can throw, and
+// have exactly the same effect as calling step on each of them; anything else
+// falls back to that. returns false if execution has to stop
+bool Snowman::stepSuper(const Instruction* ins) {
+    if (ins[0].super == PIPELINE) return stepPipeline(ins);
+    const Instruction& a = ins[0], & b = ins[1];
+    // (the debug trace shows every instruction of a pair)
+    if (debugOutput) return step(a) && step(b);
+
+    int act[8], n = 0;
+    for (int i = 0; i < 8; ++i) if (activeVars[i]) act[n++] = i;
+
+    switch (a.super) {
+    case NUM_BINARY: {
+        // the number never has to be stored if the operator consumes it
+        if (n < 2) break;
+        int s = -1; // where the number would be stored
+        for (int i = 0; i < n; ++i) {
+            if (vars[act[i]].type == Variable::UNDEFINED) {
+                s = act[i];
+                break;
+            }
+        }
+        tNum x[2];
+        int low[2];
+        for (int i = 0; i < 2; ++i) {
+            if (act[i] == s) {
+                x[i] = a.num;
+                low[i] = a.numLow;
+            } else if (vars[act[i]].type == Variable::NUM) {
+                x[i] = vars[act[i]].numVal;
+                low[i] = vars[act[i]].numLow;
+            } else return step(a) && step(b);
+        }
+        Variable result = binaryResult(b.op, x[0], low[0], x[1], low[1]);
+        if (b.consume) {
+            if (s != -1 && s != act[0] && s != act[1]) {
+                vars[s] = Variable(a.num, a.numLow);
+            }
+            vars[act[0]] = result;
+            vars[act[1]] = Variable();
+        } else {
+            if (s != -1) vars[s] = Variable(a.num, a.numLow);
+            store(result);
+        }
+        return true;
+    }
+    case STR_PRINT:
+        // the string would be stored in the first active variable and taken
+        // right back out, so it doesn't have to become an array at all
+        if (n < 1 || vars[act[0]].type != Variable::UNDEFINED) break;
+        *out << a.str;
+        return true;
+    }
+    return step(a) && step(b);
+}
+
+// execute a pipeline in one pass over its source array. this is only done
+// where fusability found that running the stages one element at a time can't
+// be told apart from running each stage over the whole array
+bool Snowman::stepPipeline(const Instruction* ins) {
+    vvs stages = ins[0].span / 2;
+    int act[8], n = 0, mask = 0;
+    for (int i = 0; i < 8; ++i) {
+        if (activeVars[i]) {
+            act[n++] = i;
+            mask |= 1 << i;
+        }
+    }
+    const Variable& pv = permavars[activePermavar];
+    int permavar = pv.type == Variable::NUM ? 1 :
+        pv.type == Variable::UNDEFINED ? 0 : -1;
+
+    // the source array has to be the only thing in the active variables
+    // (so the first block literal ends up next to it, and the stages start
+    // with nothing else around)
+    bool fusable = ins[0].fusable[(permavar + 1) * 256 + mask] &&
+        vars[act[0]].type == Variable::ARRAY;
+    for (int i = 1; fusable && i < n; ++i) {
+        fusable = vars[act[i]].type == Variable::UNDEFINED;
+    }
+    fusable = fusable && vars[act[0]].arrayVal->numbers();
+    if (!fusable) {
+        for (vvs i = 0; i < 2*stages; ++i) if (!step(ins[i])) return false;
+        return true;
+    }
+
+    if (debugOutput) {
+        *out << "<[T]> (fused)";
+        for (vvs i = 0; i < 2*stages; ++i) *out << " " << ins[i].token;
+        *out << std::endl;
+    }
+
+    // the source array and the first block literal would be consumed right
+    // away, so only a reference to the array is kept
+    tArray* arr = vars[act[0]].arrayVal;
+    vars[act[0]] = Variable();
+    std::vector<tBlock*> blocks;
+    for (vvs s = 0; s < stages; ++s) {
+        blocks.push_back(ins[2*s].literal.share().blockVal);
+    }
+    bool fold = ins[2*stages - 1].op == HSH2('a','f'), folding = false;
+    tArray* result = fold ? nullptr : new tArray;
+    if (result) result->form = tArray::DENSE;
+    Variable acc;
+
+    // (a limit can stop the run inside a block; what the pipeline holds is
+    //   let go of on the way out, as the unfused operators' Retrievals and
+    //   Owned results are)
+    try {
+        for (vvs i = 0; i < arr->length(); ++i) {
+            Variable v = arr->element(i);
+            bool keep = true;
+            for (vvs s = 0; keep && s < stages; ++s) {
+                switch (ins[2*s + 1].op) {
+                case HSH2('a','m'):
+                    store(v);
+                    run(blocks[s]);
+                    v = retrieve(-1, true);
+                    break;
+                case HSH3('A','S','E'):
+                    store(v);
+                    run(blocks[s]);
+                    keep = toBool(retrieve(-1, true, -1));
+                    break;
+                case HSH2('a','f'):
+                    if (folding) {
+                        store(acc);
+                        store(v);
+                        run(blocks[s]);
+                        v = retrieve(-1, true);
+                    }
+                    acc = v;
+                    folding = true;
+                    break;
+                }
+            }
+            if (keep && !fold) result->append(v);
+        }
+    } catch (SnowmanLimitException& se) {
+        arr->release();
+        for (tBlock* blk : blocks) blk->release();
+        if (result) result->release();
+        throw;
+    }
+
+    arr->release();
+    for (tBlock* blk : blocks) blk->release();
+    if (fold) store(folding ? acc : Variable(0.0));
+    else store(Variable(result));
+    if (debugOutput) *out << "<[D]> " << debug();
+    return true;
+}
+
+// count the pairs of instructions in some code that could be superinstructions
+// (for tools/superinstructions.sh)
+std::map<std::pair<std::string, std::string>, unsigned long>
+        Snowman::countPairs(std::string code) {
+    std::map<std::pair<std::string, std::string>, unsigned long> pairs;
+    std::vector<std::string> tokens = tokenize(code);
+    for (vvs i = 0; i < tokens.size(); ++i) {
+        Instruction a = decode(tokens[i]);
+        if (a.type == Instruction::BLOCK) {
+            for (auto& p : countPairs(a.str)) pairs[p.first] += p.second;
+        }
+        if (i + 1 == tokens.size()) break;
+        Instruction b = decode(tokens[i+1]);
+        if (kind(a, b) != NONE) ++pairs[std::make_pair(key(a), key(b))];
+    }
+    return pairs;
+}
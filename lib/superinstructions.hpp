@@ -0,0 +1,9 @@
+// generated by tools/superinstructions.sh; do not edit
+// {first instruction, second instruction, times seen in the corpus}
+{"<num>", "eq", 4},
+{"<num>", "ng", 4},
+{"<num>", "nl", 4},
+{"<num>", "na", 3},
+{"<str>", "sp", 3},
+{"<num>", "NMO", 2},
+{"<num>", "ns", 2},
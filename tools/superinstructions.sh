@@ -0,0 +1,29 @@
+#!/bin/sh
+# regenerate lib/superinstructions.hpp (the pairs of instructions that the
+# interpreter fuses into superinstructions) from a corpus of Snowman programs
+#
+# usage: tools/superinstructions.sh [-n COUNT] [FILE]...
+#   COUNT is how many of the most frequent pairs to keep (default 16); FILE
+#   defaults to every program in examples. run from the top of the repository
+#   after building lib/snowman
+
+count=16
+if [ "$1" = "-n" ]; then
+    count=$2
+    shift 2
+fi
+[ $# -eq 0 ] && set -- examples/*.snowman
+
+for f in "$@"; do
+    lib/snowman --count-pairs "$f" || exit 1
+done | awk '{ n[$1 " " $2] += $3 } END { for (p in n) print n[p], p }' |
+    sort -k1,1nr -k2,3 | head -n "$count" > lib/superinstructions.hpp.tmp ||
+    exit 1
+
+{
+    echo "// generated by tools/superinstructions.sh; do not edit"
+    echo "// {first instruction, second instruction, times seen in the corpus}"
+    awk '{ printf "{\"%s\", \"%s\", %s},\n", $2, $3, $1 }' \
+        lib/superinstructions.hpp.tmp
+} > lib/superinstructions.hpp
+rm lib/superinstructions.hpp.tmp